@@ -84,7 +84,10 @@ bool load_tracts(const char* file_name,std::shared_ptr<fib_data> handle,std::sha
         tipl::out() << "ERROR: " << file_name << " does not exist. terminating..." << std::endl;
         return 1;
     }
-    if(!tract_model->load_tracts_from_file(file_name,handle.get(),std::string(file_name).find("mni") != std::string::npos))
+    std::vector<tipl::vector<3,short> > region;
+    roi_mgr->get_required_region(region);
+    if(!tract_model->load_tracts_from_file(file_name,handle.get(),std::string(file_name).find("mni") != std::string::npos,
+                                           region.empty() ? nullptr : &region))
     {
         tipl::out() << "ERROR: cannot read or parse " << file_name << std::endl;
         return false;
@@ -62,6 +62,47 @@ int atl(tipl::program_option<tipl::out>& po)
         }
         return 0;
     }
+    if(cmd=="db" && po.has("append"))
+    {
+        // add subjects to an existing db without rewriting the stored subject data.
+        // the new subjects go to <db>.append<k>.gz, which must travel with the db file
+        std::shared_ptr<fib_data> db_fib(new fib_data);
+        db_fib->db.metadata_only = true;
+        if(!db_fib->load_from_file(po.get("append").c_str()) || !db_fib->db.has_db())
+        {
+            tipl::out() << "ERROR: cannot load connectometry db " << po.get("append") << std::endl;
+            return 1;
+        }
+        if(!db_fib->db.demo.empty() && !po.has("demo"))
+        {
+            tipl::out() << "ERROR: the db has demographics. Use --demo to provide them for all subjects, including the appended ones" << std::endl;
+            return 1;
+        }
+        std::vector<std::string> file_list,subject_list;
+        for (unsigned int index = 0;index < name_list.size();++index)
+        {
+            if(name_list[index].find(".db.fib.gz") != std::string::npos)
+                continue;
+            file_list.push_back(name_list[index]);
+            subject_list.push_back(QFileInfo(name_list[index].c_str()).baseName().toStdString());
+        }
+        if(!db_fib->db.add(file_list,subject_list,po.get("thread_count",std::min<unsigned int>(8,std::thread::hardware_concurrency()))))
+        {
+            tipl::out() << "ERROR: failed to load subject fib file " << db_fib->db.error_msg << std::endl;
+            return 1;
+        }
+        if(po.has("demo") && !db_fib->db.parse_demo(po.get("demo")))
+        {
+            tipl::out() << "ERROR: " << db_fib->db.error_msg <<std::endl;
+            return 1;
+        }
+        if(!db_fib->db.append_db())
+        {
+            tipl::out() << "ERROR: " << db_fib->db.error_msg << std::endl;
+            return 1;
+        }
+        return 0;
+    }
     if(cmd=="db")
     {        
         for(size_t id = 0;id < fib_template_list.size();++id)
@@ -139,17 +180,18 @@ int atl(tipl::program_option<tipl::out>& po)
             }
             tipl::out() << "extracting " << index_name[i] << std::endl;
             data->handle->db.index_name = index_name[i];
+            std::vector<std::string> file_list,subject_list;
             for (unsigned int index = 0;index < name_list.size();++index)
             {
                 if(name_list[index].find(".db.fib.gz") != std::string::npos)
                     continue;
-                tipl::out() << "reading " << name_list[index] << std::endl;
-                if(!data->handle->db.add(name_list[index],
-                    QFileInfo(name_list[index].c_str()).baseName().toStdString()))
-                {
-                    tipl::out() << "ERROR: failed to load subject fib file " << data->handle->db.error_msg << std::endl;
-                    return 1;
-                }
+                file_list.push_back(name_list[index]);
+                subject_list.push_back(QFileInfo(name_list[index].c_str()).baseName().toStdString());
+            }
+            if(!data->handle->db.add(file_list,subject_list,po.get("thread_count",std::min<unsigned int>(8,std::thread::hardware_concurrency()))))
+            {
+                tipl::out() << "ERROR: failed to load subject fib file " << data->handle->db.error_msg << std::endl;
+                return 1;
             }
             // Output
 
@@ -158,6 +200,8 @@ int atl(tipl::program_option<tipl::out>& po)
                 tipl::out() << "ERROR: " << data->handle->db.error_msg <<std::endl;
                 return 1;
             }
+            data->handle->db.fixel_major = po.get("fixel_major",0);
+            data->handle->db.fixel_quantize = po.get("fixel_quantize",0);
             std::string output = std::string(name_list.front().begin(),
                                              std::mismatch(name_list.front().begin(),name_list.front().begin()+
                                              int64_t(std::min(name_list.front().length(),name_list.back().length())),
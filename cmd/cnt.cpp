@@ -28,6 +28,8 @@ int cnt(tipl::program_option<tipl::out>& po)
         }
         if(po.has("save_db"))
         {
+            db.fixel_major = po.get("fixel_major",0);
+            db.fixel_quantize = po.get("fixel_quantize",0);
             db.save_db(po.get("save_db").c_str());
             return 0;
         }
@@ -105,6 +107,11 @@ int cnt(tipl::program_option<tipl::out>& po)
         vbc->tip_iteration = po.get("tip_iteration",16);
         vbc->fdr_threshold = po.get("fdr_threshold",0.0f);
         vbc->t_threshold = po.get("t_threshold",2.5f);
+        vbc->discard_null_tracts = po.get("discard_null_tracts",0);
+        vbc->fdr_snapshot_interval = po.get("fdr_snapshot",uint32_t(0));
+        vbc->fdr_converge = po.get("fdr_converge",0.0f);
+        if(vbc->fdr_converge > 0.0f && !vbc->fdr_snapshot_interval)
+            vbc->fdr_snapshot_interval = 100;
 
         // select cohort and feature
         vbc->model.reset(new stat_model);
@@ -133,12 +140,48 @@ int cnt(tipl::program_option<tipl::out>& po)
 
     {
         tipl::progress prog("running connectometry");
-        if(po.has("output"))
-            vbc->output_file_name = po.get("output",std::string());
+        vbc->output_file_name = po.get("output",vbc->get_file_post_fix());
+        // a killed run restarted with the same checkpoint continues from the last saved permutation
+        if(po.has("checkpoint"))
+        {
+            vbc->checkpoint_file_name = po.get("checkpoint",std::string());
+            if(vbc->checkpoint_file_name == "1")
+                vbc->checkpoint_file_name = vbc->output_file_name+".checkpoint.txt";
+            vbc->checkpoint_interval = po.get("checkpoint_interval",uint32_t(10));
+        }
+        // --permutation_range=a:b runs permutations a to b-1 and saves them as a partial result
+        // --merge=part1,part2,... combines partial results into the final output
+        if(po.has("permutation_range"))
+        {
+            QStringList range = QString(po.get("permutation_range").c_str()).split(":");
+            if(range.size() != 2 || range[0].toUInt() >= range[1].toUInt())
+            {
+                tipl::out() << "ERROR: invalid permutation_range " << po.get("permutation_range") << std::endl;
+                return 1;
+            }
+            vbc->permutation_begin = range[0].toUInt();
+            vbc->permutation_end = range[1].toUInt();
+            if(vbc->checkpoint_file_name.empty())
+                vbc->checkpoint_file_name = vbc->output_file_name+".part"+
+                        range[0].toStdString()+"_"+range[1].toStdString()+".txt";
+        }
+        if(po.has("merge"))
+            for(auto each : QString(po.get("merge").c_str()).split(","))
+                vbc->partial_file_names.push_back(each.toStdString());
+        // runs that will be merged need the same seed count
+        vbc->fixed_seed_count = po.get("seed_count",uint32_t(0));
+
         vbc->run_permutation(po.get("thread_count",std::thread::hardware_concurrency()),po.get("permutation",uint32_t(2000)));
         for(auto& thread: vbc->threads)
             if(thread.joinable())
                 thread.join();
+        if(vbc->terminated)
+            return 1;
+    }
+    if(po.has("permutation_range") && !po.has("merge"))
+    {
+        tipl::out() << "partial result saved to " << vbc->checkpoint_file_name << std::endl;
+        return 0;
     }
     vbc->save_result();
     vbc->calculate_FDR();
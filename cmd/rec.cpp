@@ -34,6 +34,12 @@ int rec(tipl::program_option<tipl::out>& po)
         src.voxel.other_output = po.get("other_output","fa,ad,rd,md,iso,rdi");
         src.voxel.r2_weighted = po.get("r2_weighted",int(0));
         src.voxel.thread_count = tipl::available_thread_count = po.get("thread_count",uint32_t(std::thread::hardware_concurrency()));
+        src.voxel.block_size = po.get("block_size",src.voxel.block_size);
+        src.voxel.voxel_major_dwi = po.get("voxel_major_dwi",int(0));
+        src.voxel.voxel_major_max_mb = po.get("voxel_major_max_mb",uint32_t(src.voxel.voxel_major_max_mb));
+        src.voxel.qsdr_exact_kernel = po.get("qsdr_exact_kernel",int(1));
+        src.voxel.qsdr_jacobian_tolerance = po.get("qsdr_jacobian_tolerance",src.voxel.qsdr_jacobian_tolerance);
+        src.voxel.qsdr_kernel_check = po.get("qsdr_kernel_check",uint32_t(0));
         src.voxel.param[0] = po.get("param0",src.voxel.param[0]);
         src.voxel.param[1] = po.get("param1",src.voxel.param[1]);
         src.voxel.param[2] = po.get("param2",src.voxel.param[2]);
@@ -90,7 +96,10 @@ int rec(tipl::program_option<tipl::out>& po)
                 return 1;
             }
             if(po.get("motion_correction",0))
+            {
+                src.voxel.motion_coarse_skip = po.get("motion_coarse_skip",0);
                 src.correct_motion();
+            }
         }
     }
 
@@ -10,7 +10,7 @@ bool load_bval(const char* file_name,std::vector<double>& bval);
 bool load_bvec(const char* file_name,std::vector<double>& b_table,bool flip_by = true);
 bool parse_dwi(const std::vector<std::string>& file_list,
                     std::vector<std::shared_ptr<DwiHeader> >& dwi_files);
-void dicom2src_and_nii(std::string dir_);
+void dicom2src_and_nii(std::string dir_,bool incremental,std::string index_file);
 bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool need_bvalbvec);
 
 bool get_bval_bvec(const std::string& bval_file,const std::string& bvec_file,size_t dwi_count,
@@ -159,7 +159,7 @@ int src(tipl::program_option<tipl::out>& po)
         if(po.get("recursive",1))
         {
             tipl::out() << "search recursively in the subdir" << std::endl;
-            dicom2src_and_nii(source);
+            dicom2src_and_nii(source,po.get("incremental",0),po.get("dicom_index",std::string()));
             return 0;
         }
         else
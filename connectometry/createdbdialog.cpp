@@ -323,19 +323,20 @@ void CreateDBDialog::on_create_data_base_clicked()
         }
         data->handle->db.index_name = ui->index_of_interest->currentText().toStdString();
 
-        tipl::progress prog("reading data");
-        for (unsigned int index = 0;prog(index,group.count());++index)
+        std::vector<std::string> file_list,subject_list;
+        for (unsigned int index = 0;index < group.count();++index)
         {
-            tipl::out() << QFileInfo(group[index]).baseName().toStdString() << std::endl;
-            if(!data->handle->db.add(group[index].toStdString(),get_file_name(group[index]).toStdString()))
-            {
-                QMessageBox::critical(this,"ERROR",data->handle->db.error_msg.c_str());
-                raise(); // for Mac
-                return;
-            }
+            file_list.push_back(group[index].toStdString());
+            subject_list.push_back(get_file_name(group[index]).toStdString());
         }
-        if(prog.aborted())
+        // each subject in flight keeps its FIB file in memory
+        if(!data->handle->db.add(file_list,subject_list,std::min<unsigned int>(8,std::thread::hardware_concurrency())))
+        {
+            if(data->handle->db.error_msg != "aborted")
+                QMessageBox::critical(this,"ERROR",data->handle->db.error_msg.c_str());
+            raise(); // for Mac
             return;
+        }
         if(!data->handle->db.save_db(ui->output_file_name->text().toStdString().c_str()))
             QMessageBox::critical(this,"ERROR",data->handle->db.error_msg.c_str());
         else
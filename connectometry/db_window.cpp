@@ -18,6 +18,9 @@ db_window::db_window(QWidget *parent,std::shared_ptr<group_connectometry_analysi
     ui(new Ui::db_window)
 {
     ui->setupUi(this);
+    // the window views and edits subject-major data
+    if(!vbc->handle->db.load_subject_qa())
+        QMessageBox::critical(this,"ERROR",vbc->handle->db.error_msg.c_str());
     ui->report->setText(vbc->handle->db.report.c_str());
     ui->vbc_view->setScene(&vbc_scene);
 
@@ -470,7 +470,7 @@ void group_connectometry::on_show_result_clicked()
         result_fib.reset(new connectometry_result);
         stat_model info;
         info.resample(*(vbc->model.get()),false,false,0);
-        vbc->calculate_spm(*result_fib.get(),info);
+        vbc->calculate_spm(*result_fib.get(),info,std::thread::hardware_concurrency());
         new_data->view_item.push_back(item("dec_t",result_fib->dec_ptr[0],new_data->dim));
         new_data->view_item.push_back(item("inc_t",result_fib->inc_ptr[0],new_data->dim));
     }
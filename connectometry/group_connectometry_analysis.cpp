@@ -7,6 +7,9 @@
 #include "tracking/tracking_window.h"
 #include "tracking/region/regiontablewidget.h"
 #include <filesystem>
+#include <map>
+#include <iterator>
+#include <iomanip>
 
 bool group_connectometry_analysis::create_database(std::shared_ptr<fib_data> handle_)
 {
@@ -31,28 +34,39 @@ bool group_connectometry_analysis::load_database(const char* database_name)
 }
 
 
-int group_connectometry_analysis::run_track(std::shared_ptr<tracking_data> fib,
+std::shared_ptr<ThreadData> group_connectometry_analysis::new_tracking_thread(void)
+{
+    // roi_mgr is prepared before tracking and only read afterward, so all contexts share it
+    auto tracking_thread = std::make_shared<ThreadData>(roi_mgr);
+    tracking_thread->param.threshold = fiber_threshold;
+    tracking_thread->param.dt_threshold = t_threshold;
+    tracking_thread->param.cull_cos_angle = 1.0f;
+    tracking_thread->param.step_size = handle->vs[0];
+    tracking_thread->param.min_length = float(length_threshold_voxels)*handle->vs[0];
+    tracking_thread->param.max_length = 2.0f*float(std::max<unsigned int>(handle->dim[0],std::max<unsigned int>(handle->dim[1],handle->dim[2])))*handle->vs[0];
+    tracking_thread->param.stop_by_tract = 0;// stop by seed
+    return tracking_thread;
+}
+
+int group_connectometry_analysis::run_track(ThreadData& tracking_thread,
+                                            std::shared_ptr<tracking_data> fib,
                                             std::vector<std::vector<float> >& tracks,
                                             unsigned int seed_count,
                                             unsigned int random_seed,
                                             unsigned int thread_count)
 {
-    ThreadData tracking_thread(handle);
     tracking_thread.param.random_seed = random_seed;
-    tracking_thread.param.threshold = fiber_threshold;
-    tracking_thread.param.dt_threshold = t_threshold;
-    tracking_thread.param.cull_cos_angle = 1.0f;
-    tracking_thread.param.step_size = handle->vs[0];
-    tracking_thread.param.min_length = float(length_threshold_voxels)*handle->vs[0];
-    tracking_thread.param.max_length = 2.0f*float(std::max<unsigned int>(handle->dim[0],std::max<unsigned int>(handle->dim[1],handle->dim[2])))*handle->vs[0];
-    tracking_thread.param.stop_by_tract = 0;// stop by seed
     tracking_thread.param.termination_count = uint32_t(seed_count);
-    tracking_thread.roi_mgr = roi_mgr;
     tracking_thread.run(fib,thread_count,true);
-    for(auto& tracts_per_thread : tracking_thread.track_buffer_front)
+    // run() flips buffer_switch after waiting, the filled buffer is the one at rest
+    auto& buffer = tracking_thread.buffer_switch ? tracking_thread.track_buffer_back : tracking_thread.track_buffer_front;
+    for(auto& tracts_per_thread : buffer)
+    {
         for(auto& tract : tracts_per_thread)
             if(!tract.empty())
                 tracks.push_back(std::move(tract));
+        tracts_per_thread.clear();
+    }
     return int(tracks.size());
 }
 
@@ -85,64 +99,269 @@ void group_connectometry_analysis::exclude_cerebellum(void)
 
 void group_connectometry_analysis::run_permutation_multithread(unsigned int id,unsigned int thread_count,unsigned int permutation_count)
 {
-    connectometry_result data;
+    // fixel-indexed T maps and one tracking context reused for all permutations of this thread
+    connectometry_result null_data,data;
+    null_data.sparse = data.sparse = true;
+    auto tracking_thread = new_tracking_thread();
     std::shared_ptr<tracking_data> fib(new tracking_data);
     fib->read(handle);
-    bool null = true;
-    for(unsigned int i = id;i < permutation_count && !terminated;)
+    fib->dt_fa.clear();
+    fib->dt_vi2si = &handle->db.vi2si[0];
+    fib->dt_fixel_count = handle->db.si2vi.size();
+    // per-thread length histograms, merged into the shared ones after each run
+    std::vector<unsigned int> inc_null(tract_count_inc_null.size()),dec_null(tract_count_dec_null.size()),
+                              inc(tract_count_inc.size()),dec(tract_count_dec.size());
+    auto merge = [](std::vector<unsigned int>& from,std::vector<unsigned int>& to)
     {
-        std::vector<std::vector<float> > pos_tracks,neg_tracks;
-
-        stat_model info;
-
-        info.resample(*model.get(),null,true,i);
-        calculate_spm(data,info);
-        fib->dt_fa = data.dec_ptr;
-
-        run_track(fib,neg_tracks,seed_count,i);
-        cal_hist(neg_tracks,(null) ? tract_count_dec_null : tract_count_dec);
-
-
-        info.resample(*model.get(),null,true,i);
-        calculate_spm(data,info);
-        fib->dt_fa = data.inc_ptr;
+        tipl::add(to,from);
+        std::fill(from.begin(),from.end(),0);
+    };
+    // only permutations in [permutation_begin,permutation_end) are run, the rest are left to other processes
+    unsigned int end = permutation_end ? std::min<unsigned int>(permutation_end,permutation_count) : permutation_count;
+    for(unsigned int i = permutation_begin+id;i < end && !terminated && !converged;i += thread_count)
+    {
+        if(permutation_completed[i]) // resumed from a checkpoint
+            continue;
+        // the permuted and nonpermuted maps share one pass over the population
+        stat_model null_info,info;
+        null_info.resample(*model.get(),true,true,i);
+        info.resample(*model.get(),false,true,i);
+        calculate_spm({&null_data,&data},{&null_info,&info});
+
+        std::vector<std::vector<float> > neg_null_tracks,pos_null_tracks,neg_tracks,pos_tracks;
+        for(bool null : {true,false})
+        {
+            auto& cur_data = null ? null_data : data;
 
-        run_track(fib,pos_tracks,seed_count,i);
-        cal_hist(pos_tracks,(null) ? tract_count_inc_null : tract_count_inc);
+            fib->dt_fixel = &cur_data.fixel_t[0];
+            fib->dt_sign = -1.0f;
+            run_track(*tracking_thread,fib,null ? neg_null_tracks : neg_tracks,seed_count,i);
+            cal_hist(null ? neg_null_tracks : neg_tracks,null ? dec_null : dec);
 
+            fib->dt_sign = 1.0f;
+            run_track(*tracking_thread,fib,null ? pos_null_tracks : pos_tracks,seed_count,i);
+            cal_hist(null ? pos_null_tracks : pos_tracks,null ? inc_null : inc);
+            if(terminated)
+                break;
+        }
+        if(terminated)
+            break;
+        // a permutation is merged as a whole so that checkpoints never hold half of one
+        bool checkpoint_due = false;
         {
             std::lock_guard<std::mutex> lock(lock_add_tracks);
-            if(null)
+            merge(dec_null,tract_count_dec_null);
+            merge(inc_null,tract_count_inc_null);
+            merge(dec,tract_count_dec);
+            merge(inc,tract_count_inc);
+            if(!discard_null_tracts)
             {
-                neg_null_corr_track->add_tracts(neg_tracks,length_threshold_voxels,tipl::rgb(0x004040F0));
-                pos_null_corr_track->add_tracts(pos_tracks,length_threshold_voxels,tipl::rgb(0x00F04040));
+                neg_null_corr_track->add_tracts(neg_null_tracks,length_threshold_voxels,tipl::rgb(0x004040F0));
+                pos_null_corr_track->add_tracts(pos_null_tracks,length_threshold_voxels,tipl::rgb(0x00F04040));
             }
-            else
+            dec_track->add_tracts(neg_tracks,length_threshold_voxels,tipl::rgb(0x004040F0));
+            inc_track->add_tracts(pos_tracks,length_threshold_voxels,tipl::rgb(0x00F04040));
+            permutation_completed[i] = 1;
+            ++permutation_done;
+            if(fdr_snapshot_interval && permutation_done % fdr_snapshot_interval == 0)
+                snapshot_FDR();
+            checkpoint_due = !checkpoint_file_name.empty() && checkpoint_interval &&
+                             permutation_done % checkpoint_interval == 0;
+        }
+        if(checkpoint_due && !save_checkpoint(false))
+            tipl::out() << "WARNING: " << error_msg << std::endl;
+        ++preprocess;
+        if(id == 0)
+            prog = uint32_t((i-permutation_begin+thread_count)*95/(end-permutation_begin));
+    }
+    if(id == 0 && !terminated)
+    {
+        wait(1); // current thread occupies 0, wait from 1
+        if(!checkpoint_file_name.empty() && !save_checkpoint(true))
+            tipl::out() << "WARNING: " << error_msg << std::endl;
+        prog = 100;
+    }
+}
+
+bool group_connectometry_analysis::save_checkpoint(bool wait)
+{
+    // one writer at a time, a periodic checkpoint is skipped if another one is being written
+    std::unique_lock<std::mutex> writing(lock_checkpoint,std::defer_lock);
+    if(wait)
+        writing.lock();
+    else
+    if(!writing.try_lock())
+        return true;
+    // the state is copied under lock_add_tracks and written to disk outside of it,
+    // so permutation threads are not blocked by compressing the tracts
+    std::string generation;
+    std::ostringstream out;
+    std::vector<std::pair<std::shared_ptr<TractModel>,std::string> > tracks;
+    {
+        std::lock_guard<std::mutex> lock(lock_add_tracks);
+        generation = std::to_string(permutation_done);
+        if(generation == checkpoint_generation)
+            return true;
+        out << "parameter " << checkpoint_parameter << std::endl;
+        out << "seed_count " << seed_count << std::endl;
+        out << "generation " << generation << std::endl;
+        out << "completed";
+        for(size_t i = 0;i < permutation_completed.size();++i)
+            if(permutation_completed[i])
+                out << " " << i;
+        out << std::endl;
+        auto write_hist = [&](const char* name,const std::vector<unsigned int>& hist)
+        {
+            out << name;
+            for(auto v : hist)
+                out << " " << v;
+            out << std::endl;
+        };
+        write_hist("tract_count_inc_null",tract_count_inc_null);
+        write_hist("tract_count_dec_null",tract_count_dec_null);
+        write_hist("tract_count_inc",tract_count_inc);
+        write_hist("tract_count_dec",tract_count_dec);
+        for(auto each : checkpoint_tracks())
+        {
+            tracks.push_back(std::make_pair(std::make_shared<TractModel>(handle),each.second));
+            std::vector<std::vector<float> > tracts(each.first->get_tracts());
+            tracks.back().first->add_tracts(tracts);
+        }
+    }
+    // tracts go to files named by generation, and the checkpoint file that refers to them
+    // is replaced last, so a kill at any point leaves the previous checkpoint intact
+    for(auto each : tracks)
+    {
+        auto count = each.first->get_visible_track_count();
+        if(count && !each.first->save_tracts_to_file((checkpoint_file_name+"."+generation+"."+each.second+".tt.gz").c_str()))
+        {
+            error_msg = "cannot write checkpoint tracts";
+            return false;
+        }
+        out << "tracts_" << each.second << " " << count << std::endl;
+    }
+    {
+        std::ofstream file((checkpoint_file_name+".tmp").c_str());
+        if(!file || !(file << out.str()))
+        {
+            error_msg = "cannot write checkpoint ";
+            error_msg += checkpoint_file_name;
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(checkpoint_file_name+".tmp",checkpoint_file_name,ec);
+    if(ec)
+    {
+        error_msg = "cannot replace checkpoint ";
+        error_msg += checkpoint_file_name;
+        return false;
+    }
+    if(!checkpoint_generation.empty())
+        for(auto each : tracks)
+            std::filesystem::remove(checkpoint_file_name+"."+checkpoint_generation+"."+each.second+".tt.gz",ec);
+    checkpoint_generation = generation;
+    tipl::out() << "checkpoint saved: " << generation << " permutations" << std::endl;
+    return true;
+}
+
+bool group_connectometry_analysis::load_checkpoint(const std::string& file_name,std::string& generation)
+{
+    // results are added to the current ones so that partial results of several runs can be merged
+    std::ifstream in(file_name.c_str());
+    if(!in)
+    {
+        error_msg = "cannot read ";
+        error_msg += file_name;
+        return false;
+    }
+    std::map<std::string,std::string> values;
+    std::string line;
+    while(std::getline(in,line))
+    {
+        auto pos = line.find(' ');
+        values[line.substr(0,pos)] = (pos == std::string::npos ? std::string() : line.substr(pos+1));
+    }
+    if(values["parameter"] != checkpoint_parameter)
+    {
+        error_msg = file_name;
+        error_msg += " was created with different parameters";
+        return false;
+    }
+    int file_seed_count = std::stoi("0"+values["seed_count"]);
+    if(file_seed_count <= 0 || (permutation_done && file_seed_count != seed_count))
+    {
+        error_msg = file_name;
+        error_msg += " has an inconsistent seed count";
+        return false;
+    }
+    std::vector<unsigned int> completed;
+    {
+        std::istringstream cin(values["completed"]);
+        for(unsigned int i;cin >> i;)
+        {
+            if(i >= permutation_completed.size() || permutation_completed[i])
             {
-                dec_track->add_tracts(neg_tracks,length_threshold_voxels,tipl::rgb(0x004040F0));
-                inc_track->add_tracts(pos_tracks,length_threshold_voxels,tipl::rgb(0x00F04040));
+                error_msg = file_name;
+                error_msg += " contains permutations out of range or already included";
+                return false;
             }
+            completed.push_back(i);
         }
-
-        if(!null)
+    }
+    std::vector<std::vector<unsigned int> > hist(4);
+    std::vector<std::vector<unsigned int>*> to = {&tract_count_inc_null,&tract_count_dec_null,&tract_count_inc,&tract_count_dec};
+    const char* hist_name[4] = {"tract_count_inc_null","tract_count_dec_null","tract_count_inc","tract_count_dec"};
+    for(size_t j = 0;j < 4;++j)
+    {
+        std::istringstream hin(values[hist_name[j]]);
+        hist[j] = std::vector<unsigned int>((std::istream_iterator<unsigned int>(hin)),std::istream_iterator<unsigned int>());
+        if(hist[j].size() != to[j]->size())
         {
-            ++preprocess;
-            i += thread_count;
-            if(id == 0)    
-                prog = uint32_t(i*95/permutation_count);
+            error_msg = "invalid length histogram in ";
+            error_msg += file_name;
+            return false;
         }
-        null = !null;
     }
-    if(id == 0 && !terminated)
+    std::vector<std::shared_ptr<TractModel> > tracks;
+    for(auto each : checkpoint_tracks())
     {
-        wait(1); // current thread occupies 0, wait from 1
-        prog = 100;
+        tracks.push_back(std::make_shared<TractModel>(handle));
+        if(std::stoul("0"+values["tracts_"+each.second]) &&
+           !tracks.back()->load_tracts_from_file((file_name+"."+values["generation"]+"."+each.second+".tt.gz").c_str(),handle.get()))
+        {
+            error_msg = "cannot read tracts of ";
+            error_msg += file_name;
+            return false;
+        }
     }
+    // everything is read, now add to the current results
+    for(size_t j = 0;j < 4;++j)
+        tipl::add(*to[j],hist[j]);
+    auto targets = checkpoint_tracks();
+    for(size_t j = 0;j < targets.size();++j)
+        if(tracks[j]->get_visible_track_count())
+            targets[j].first->add_tracts(tracks[j]->get_tracts(),
+                targets[j].second.find("inc") == 0 ? tipl::rgb(0x00F04040) : tipl::rgb(0x004040F0));
+    for(auto i : completed)
+        permutation_completed[i] = 1;
+    permutation_done += completed.size();
+    seed_count = file_seed_count;
+    generation = values["generation"];
+    return true;
+}
+std::vector<std::pair<std::shared_ptr<TractModel>,std::string> > group_connectometry_analysis::checkpoint_tracks(void)
+{
+    return {{inc_track,"inc"},{dec_track,"dec"},{pos_null_corr_track,"inc_null"},{neg_null_corr_track,"dec_null"}};
 }
 void group_connectometry_analysis::save_result(void)
 {
     tipl::progress prog("save correlational tractography results");
-    for(size_t index = 0;index < tip_iteration;++index)
+    // discarded null tracts only left untrimmed histograms, and pruning needs the whole tract model,
+    // so the observed tracts are not pruned either to keep the FDR comparison unbiased
+    if(discard_null_tracts && tip_iteration)
+        tipl::out() << "topology-informed pruning is skipped because null tracts were discarded" << std::endl;
+    for(size_t index = 0;!discard_null_tracts && index < tip_iteration;++index)
     {
         neg_null_corr_track->trim();
         pos_null_corr_track->trim();
@@ -150,14 +369,18 @@ void group_connectometry_analysis::save_result(void)
         inc_track->trim();
     }
     // update fdr table
-    std::fill(tract_count_dec_null.begin(),tract_count_dec_null.end(),0);
-    std::fill(tract_count_inc_null.begin(),tract_count_inc_null.end(),0);
     std::fill(tract_count_dec.begin(),tract_count_dec.end(),0);
     std::fill(tract_count_inc.begin(),tract_count_inc.end(),0);
     cal_hist(dec_track->get_tracts(),tract_count_dec);
-    cal_hist(neg_null_corr_track->get_tracts(),tract_count_dec_null);
     cal_hist(inc_track->get_tracts(),tract_count_inc);
-    cal_hist(pos_null_corr_track->get_tracts(),tract_count_inc_null);
+    // discarded null tracts only left their histograms
+    if(!discard_null_tracts)
+    {
+        std::fill(tract_count_dec_null.begin(),tract_count_dec_null.end(),0);
+        std::fill(tract_count_inc_null.begin(),tract_count_inc_null.end(),0);
+        cal_hist(neg_null_corr_track->get_tracts(),tract_count_dec_null);
+        cal_hist(pos_null_corr_track->get_tracts(),tract_count_inc_null);
+    }
     calculate_FDR();
 
     // output distribution values
@@ -329,51 +552,220 @@ void group_connectometry_analysis::calculate_adjusted_qa(stat_model& info)
     // population_value_adjusted is a transpose of handle->db.subject_qa
     population_value_adjusted.clear();
     population_value_adjusted.resize(handle->db.subject_qa_length);
-    tipl::par_for(handle->db.si2vi.size(),[&](size_t s_index)
+    // ranks are fixed across permutations and only need to be sorted once
+    population_rank.clear();
+    if(info.study_feature && info.selected_subject.size() <= 65536)
+        population_rank.resize(handle->db.subject_qa_length);
+    // covariates are removed from blocks of fixels at once: C = Y*P', Y -= C*Xc'
+    // P and Xc are shared by every fixel and stay in cache across a block
+    std::vector<float> P,Xc;
+    const size_t n = info.selected_subject.size();
+    const size_t k = n ? info.partial_correlation_projection(P,Xc) : 0;
+    auto adjust = [&](const std::vector<size_t>& s_index_list,auto get_value)
     {
-        size_t pos = handle->db.si2vi[s_index];
-        for(size_t fib = 0;s_index < handle->db.subject_qa_length &&
-                           handle->dir.fa[fib][pos] > fiber_threshold;++fib,s_index += handle->db.si2vi.size())
+        const size_t block_size = 256;
+        tipl::par_for((s_index_list.size()+block_size-1)/block_size,[&](size_t block)
         {
-            std::vector<float> population(info.selected_subject.size());
-            for(unsigned int index = 0;index < info.selected_subject.size();++index)
-                population[index] = handle->db.subject_qa[info.selected_subject[index]][s_index];
-
-            if(!population.empty())
+            size_t from = block*block_size;
+            size_t size = std::min(block_size,s_index_list.size()-from);
+            std::vector<float> C(size*k);
+            std::vector<std::vector<float> > Y(size,std::vector<float>(n));
+            for(size_t j = 0;j < size;++j)
             {
-                info.partial_correlation(population);
-                population_value_adjusted[s_index] = std::move(population);
+                auto& y = Y[j];
+                for(size_t index = 0;index < n;++index)
+                    y[index] = get_value(from+j,info.selected_subject[index]);
+                for(size_t l = 0;l < k;++l)
+                {
+                    const float* p = P.data()+l*n;
+                    double sum = 0.0;
+                    for(size_t index = 0;index < n;++index)
+                        sum += double(p[index])*y[index];
+                    C[j*k+l] = float(sum);
+                }
             }
+            for(size_t j = 0;j < size;++j)
+            {
+                auto& y = Y[j];
+                const float* c = C.data()+j*k;
+                if(k)
+                    for(size_t index = 0;index < n;++index)
+                    {
+                        const float* x = Xc.data()+index*k;
+                        float sum = 0.0f;
+                        for(size_t l = 0;l < k;++l)
+                            sum += x[l]*c[l];
+                        y[index] -= sum;
+                    }
+                size_t s_index = s_index_list[from+j];
+                if(!population_rank.empty())
+                {
+                    // populations with tied values keep no ranks and are ranked by tipl::rank in each permutation
+                    auto rank = tipl::rank(y,std::less<float>());
+                    std::vector<float> sorted_y(n);
+                    for(size_t index = 0;index < n;++index)
+                        sorted_y[rank[index]] = y[index];
+                    if(std::adjacent_find(sorted_y.begin(),sorted_y.end()) == sorted_y.end())
+                        population_rank[s_index] = std::vector<uint16_t>(rank.begin(),rank.end());
+                }
+                population_value_adjusted[s_index] = std::move(y);
+            }
+        });
+    };
+    if(!n)
+        return;
+    const auto& db = handle->db;
+    // fixel-major chunks already hold each population contiguously
+    bool from_chunk = db.fixel_chunk_count && db.num_subjects;
+    std::vector<float> chunk;
+    for(unsigned int c = 0;from_chunk && c < db.fixel_chunk_count;++c)
+    {
+        if(!db.get_fixel_chunk(c,chunk))
+        {
+            tipl::out() << "WARNING: " << db.error_msg << ", use subject-major data instead" << std::endl;
+            from_chunk = false;
+            break;
+        }
+        size_t from = size_t(c)*db.fixel_chunk_size;
+        std::vector<size_t> s_index_list,offset;
+        for(size_t j = 0;j < chunk.size()/db.num_subjects;++j)
+        {
+            size_t s_index = from+j;
+            size_t pos = db.si2vi[s_index % db.si2vi.size()];
+            bool valid = true;
+            for(size_t fib = 0;fib <= s_index/db.si2vi.size() && valid;++fib)
+                valid = handle->dir.fa[fib][pos] > fiber_threshold;
+            if(valid)
+            {
+                s_index_list.push_back(s_index);
+                offset.push_back(j*db.num_subjects);
+            }
+        }
+        adjust(s_index_list,[&](size_t j,unsigned int subject){return chunk[offset[j]+subject];});
+    }
+    if(!from_chunk)
+    {
+        if(!handle->db.load_subject_qa())
+        {
+            tipl::out() << "ERROR: " << handle->db.error_msg << std::endl;
+            return;
+        }
+        std::vector<size_t> s_index_list;
+        for(size_t si = 0;si < db.si2vi.size();++si)
+        {
+            size_t pos = db.si2vi[si];
+            for(size_t fib = 0,s_index = si;s_index < db.subject_qa_length &&
+                               handle->dir.fa[fib][pos] > fiber_threshold;++fib,s_index += db.si2vi.size())
+                s_index_list.push_back(s_index);
         }
-    });
+        adjust(s_index_list,[&](size_t j,unsigned int subject){return db.subject_qa[subject][s_index_list[j]];});
+    }
 }
 
-void group_connectometry_analysis::calculate_spm(connectometry_result& data,stat_model& info)
+void group_connectometry_analysis::calculate_spm(const std::vector<connectometry_result*>& data,
+                                                 const std::vector<const stat_model*>& info,
+                                                 unsigned int thread_count)
 {
-    data.clear_result(handle->dir.num_fiber,handle->dim.size());
-    for(size_t s_index = 0;s_index < handle->db.si2vi.size() && !terminated;++s_index)
-    {
-        size_t pos = handle->db.si2vi[s_index];
-        double T_stat(0.0); // declare here so that the T-stat of the 1st fiber can be applied to others if there is only one metric per voxel
-        for(size_t fib = 0,cur_s_index = s_index;
-            fib < handle->dir.num_fiber && handle->dir.fa[fib][pos] > fiber_threshold;
-            ++fib,cur_s_index += handle->db.si2vi.size())
-        {
-            // some connectometry database only have 1 metrics per voxel
-            // and thus the computed statistics will be applied to all fibers
-            if(cur_s_index < population_value_adjusted.size())
+    const auto& si2vi = handle->db.si2vi;
+    for(auto each : data)
+        if(each->sparse)
+            each->clear_fixel_result(handle->dir.num_fiber,si2vi.size());
+        else
+            each->clear_result(handle->dir.num_fiber,handle->dim.size());
+    const size_t chunk_size = 1024;
+    const size_t K = info.size();
+    thread_count = std::max<unsigned int>(1,thread_count);
+
+    // longitudinal change: each T is mean/se of a[i]*population[sample_map[i]], so the K maps
+    // come from two (fixels x subjects) x (subjects x K) products against the subject weights
+    bool sign_flip = !info[0]->study_feature;
+    size_t n = info[0]->sample_map.size();
+    std::vector<double> w,w2;
+    if(sign_flip)
+    {
+        w.resize(n*K);
+        w2.resize(n*K);
+        for(size_t k = 0;k < K;++k)
+            for(size_t i = 0;i < n;++i)
             {
-                if(population_value_adjusted[cur_s_index][0] == 0.0f)
-                    continue;
-                T_stat = info(population_value_adjusted[cur_s_index]);
+                // same sign-flip rule as stat_model::operator()
+                double a = info[k]->permutation_order.empty() ? 1.0 : (info[k]->permutation_order[i] ? -1.0 : 0.0);
+                size_t j = info[k]->sample_map[i]*K+k;
+                w[j] += a;
+                w2[j] += a*a;
             }
-
-            if(T_stat > 0.0)
-                data.inc[fib][pos] = T_stat;
-            if(T_stat < 0.0)
-                data.dec[fib][pos] = -T_stat;
-        }
     }
+
+    std::vector<stat_model::buffer> buf(thread_count);
+    std::vector<std::vector<double> > T_buf(thread_count,std::vector<double>(K*3));
+    tipl::par_for(thread_count,[&](size_t thread_id)
+    {
+        double* T_stat = T_buf[thread_id].data();
+        double* sum = T_stat+K;
+        double* sum2 = sum+K;
+        for(size_t from = thread_id*chunk_size;from < si2vi.size() && !terminated;from += thread_count*chunk_size)
+            for(size_t s_index = from,to = std::min(si2vi.size(),from+chunk_size);s_index < to;++s_index)
+            {
+                size_t pos = si2vi[s_index];
+                // declare here so that the T-stat of the 1st fiber can be applied to others if there is only one metric per voxel
+                std::fill(T_stat,T_stat+K,0.0);
+                for(size_t fib = 0,cur_s_index = s_index;
+                    fib < handle->dir.num_fiber && handle->dir.fa[fib][pos] > fiber_threshold;
+                    ++fib,cur_s_index += si2vi.size())
+                {
+                    // some connectometry database only have 1 metrics per voxel
+                    // and thus the computed statistics will be applied to all fibers
+                    if(cur_s_index < population_value_adjusted.size())
+                    {
+                        const auto& population = population_value_adjusted[cur_s_index];
+                        if(population[0] == 0.0f)
+                            continue;
+                        if(sign_flip)
+                        {
+                            // the weight rows stay in cache while the population streams through once
+                            std::fill(sum,sum+K+K,0.0);
+                            for(size_t j = 0;j < n;++j)
+                            {
+                                double p = population[j];
+                                double p2 = p*p;
+                                const double* w_row = w.data()+j*K;
+                                const double* w2_row = w2.data()+j*K;
+                                for(size_t k = 0;k < K;++k)
+                                {
+                                    sum[k] += p*w_row[k];
+                                    sum2[k] += p2*w2_row[k];
+                                }
+                            }
+                            for(size_t k = 0;k < K;++k)
+                            {
+                                double mean = sum[k]/double(n);
+                                double var = sum2[k]/double(n)-mean*mean;
+                                T_stat[k] = var <= 0.0 ? 0.0 : mean/std::sqrt(var/double(n));
+                            }
+                        }
+                        else
+                        {
+                            const uint16_t* rank = population_rank.empty() || population_rank[cur_s_index].empty() ?
+                                                   nullptr : population_rank[cur_s_index].data();
+                            for(size_t k = 0;k < K;++k)
+                                T_stat[k] = (*info[k])(population,rank,buf[thread_id]);
+                        }
+                    }
+                    for(size_t k = 0;k < K;++k)
+                    {
+                        if(data[k]->sparse)
+                        {
+                            data[k]->fixel_t[fib*si2vi.size()+s_index] = float(T_stat[k]);
+                            continue;
+                        }
+                        if(T_stat[k] > 0.0)
+                            data[k]->inc[fib][pos] = T_stat[k];
+                        if(T_stat[k] < 0.0)
+                            data[k]->dec[fib][pos] = -T_stat[k];
+                    }
+                }
+            }
+    },thread_count);
 }
 
 void group_connectometry_analysis::run_permutation(unsigned int thread_count,unsigned int permutation_count)
@@ -474,9 +866,12 @@ void group_connectometry_analysis::run_permutation(unsigned int thread_count,uns
 
         if(!roi_mgr->report.empty())
             out << roi_mgr->report << std::endl;
-        if(tip_iteration)
+        if(tip_iteration && !discard_null_tracts)
             out << " The tracks were filtered by topology-informed pruning (Yeh et al. Neurotherapeutics, 16(1), 52-58, 2019) with "
                 << tip_iteration << " iteration(s).";
+        if(tip_iteration && discard_null_tracts)
+            out << " Topology-informed pruning was not applied because the null tracks were summarized only by their length distribution"
+                << " and could not be pruned in the same way as the observed tracks.";
         if(fdr_threshold == 0.0f)
             out << " A length threshold of " << length_threshold_voxels << " voxel distance was used to select tracks.";
         else
@@ -515,9 +910,69 @@ void group_connectometry_analysis::run_permutation(unsigned int thread_count,uns
     spm_map = std::make_shared<connectometry_result>();
 
     terminated = false;
+    converged = false;
+    permutation_done = 0;
+    fdr_inc_snapshot.clear();
+    fdr_dec_snapshot.clear();
+    if(fdr_snapshot_interval)
+        std::ofstream((output_file_name+".fdr_snapshot.txt").c_str()) << "permutation\tfdr_inc\tfdr_dec" << std::endl;
     prog = 0;
+    // seeds are set once here and shared read-only by all permutation threads
+    if(roi_mgr->seeds.empty())
+        roi_mgr->setWholeBrainSeed(fiber_threshold);
+
+    permutation_completed.clear();
+    permutation_completed.resize(permutation_count);
+    {
+        // exact thresholds, and a hash of the subjects and covariates that enter the model
+        uint64_t hash = 14695981039346656037ull;
+        auto add_hash = [&](const void* data,size_t size)
+        {
+            for(size_t i = 0;i < size;++i)
+                hash = (hash ^ reinterpret_cast<const unsigned char*>(data)[i])*1099511628211ull;
+        };
+        add_hash(model->selected_subject.data(),model->selected_subject.size()*sizeof(unsigned int));
+        add_hash(model->X.data(),model->X.size()*sizeof(double));
+        std::ostringstream out;
+        out << std::setprecision(9) << handle->db.index_name << " " << foi_str << " " << model->study_feature
+            << " t" << t_threshold << " fdr" << fdr_threshold << " length" << length_threshold_voxels
+            << " fiber" << fiber_threshold << " " << model->selected_subject.size() << " " << permutation_count
+            << " " << tip_iteration << " " << discard_null_tracts;
+        for(const auto& each : model->variables)
+            out << " " << each;
+        out << " " << std::hex << hash << std::dec << " " << roi_mgr->report;
+        checkpoint_parameter = out.str();
+        std::replace(checkpoint_parameter.begin(),checkpoint_parameter.end(),'\n',' ');
+    }
+    checkpoint_generation.clear();
+    bool resumed = false;
+    if(!partial_file_names.empty())
+    {
+        // merge partial results from other runs, no permutation left to run here
+        for(const auto& file_name : partial_file_names)
+        {
+            std::string generation;
+            if(!load_checkpoint(file_name,generation))
+            {
+                tipl::out() << "ERROR: " << error_msg << std::endl;
+                terminated = true;
+                return;
+            }
+            tipl::out() << "merged " << file_name << std::endl;
+        }
+        if(permutation_done < permutation_count)
+            tipl::out() << "WARNING: the partial results only cover " << permutation_done << " of " << permutation_count << " permutations" << std::endl;
+        resumed = true;
+    }
+    else
+    if(!checkpoint_file_name.empty() && std::filesystem::exists(checkpoint_file_name))
+    {
+        if(!(resumed = load_checkpoint(checkpoint_file_name,checkpoint_generation)))
+            tipl::out() << error_msg << ", starting over" << std::endl;
+    }
     // preliminary run
     {
+        auto tracking_thread = new_tracking_thread();
         std::shared_ptr<tracking_data> fib(new tracking_data);
         fib->read(handle);
 
@@ -525,32 +980,83 @@ void group_connectometry_analysis::run_permutation(unsigned int thread_count,uns
 
         stat_model info;
         info.resample(*model.get(),false,false,0);
-        tipl::out() << "preliminary run to determine seed count" << std::endl;
-        calculate_spm(*spm_map.get(),info);
-        preprocess = 0;
-        seed_count = 1000;
-
-        const size_t expected_tract_count = 50000;
-        auto expected_tract_per_permutation = expected_tract_count/permutation_count;
-        while(seed_count < 128000)
+        calculate_spm(*spm_map.get(),info,std::thread::hardware_concurrency());
+        if(resumed)
         {
-            std::vector<std::vector<float> > tracks;
-            fib->dt_fa = spm_map->dec_ptr;
-            run_track(fib,tracks,seed_count,0,std::thread::hardware_concurrency());
-            fib->dt_fa = spm_map->inc_ptr;
-            run_track(fib,tracks,seed_count,0,std::thread::hardware_concurrency());
-            if(tracks.size() > expected_tract_per_permutation)
-                break;
-            seed_count *= 2;
+            preprocess = permutation_done;
+            tipl::out() << "resume from " << permutation_done << " completed permutations" << std::endl;
+            tipl::out() << "seed count: " << seed_count << std::endl;
+        }
+        else
+        if(fixed_seed_count)
+        {
+            preprocess = 0;
+            seed_count = int(fixed_seed_count);
+            tipl::out() << "seed count: " << seed_count << std::endl;
+        }
+        else
+        {
+            tipl::out() << "preliminary run to determine seed count" << std::endl;
+            preprocess = 0;
+            seed_count = 1000;
+            // a fixed thread count gives the same seed count on every machine, so split runs can be merged
+            const unsigned int search_thread_count = 8;
+
+            const size_t expected_tract_count = 50000;
+            auto expected_tract_per_permutation = expected_tract_count/permutation_count;
+            while(seed_count < 128000)
+            {
+                std::vector<std::vector<float> > tracks;
+                fib->dt_fa = spm_map->dec_ptr;
+                run_track(*tracking_thread,fib,tracks,seed_count,0,search_thread_count);
+                fib->dt_fa = spm_map->inc_ptr;
+                run_track(*tracking_thread,fib,tracks,seed_count,0,search_thread_count);
+                if(tracks.size() > expected_tract_per_permutation)
+                    break;
+                seed_count *= 2;
+            }
+            tipl::out() << "seed count: " << seed_count << std::endl;
         }
-        tipl::out() << "seed count: " << seed_count << std::endl;
     }
 
+    if(!partial_file_names.empty())
+    {
+        prog = 100;
+        return;
+    }
     for(unsigned int index = 0;index < thread_count;++index)
         threads.push_back(std::thread([=](){run_permutation_multithread(index,thread_count,permutation_count);}));
 }
 
 void group_connectometry_analysis::calculate_FDR(void)
+{
+    std::lock_guard<std::mutex> lock(lock_add_tracks);
+    update_FDR();
+}
+
+void group_connectometry_analysis::snapshot_FDR(void)
+{
+    update_FDR();
+    std::ofstream((output_file_name+".fdr_snapshot.txt").c_str(),std::ios::app)
+            << permutation_done << "\t" << fdr_inc[length_threshold_voxels]
+            << "\t" << fdr_dec[length_threshold_voxels] << std::endl;
+    if(fdr_converge > 0.0f && !fdr_inc_snapshot.empty())
+    {
+        float change = 0.0f;
+        for(size_t index = length_threshold_voxels;index < fdr_inc.size();++index)
+            change = std::max<float>(change,std::max<float>(std::fabs(fdr_inc[index]-fdr_inc_snapshot[index]),
+                                                            std::fabs(fdr_dec[index]-fdr_dec_snapshot[index])));
+        if(change < fdr_converge)
+        {
+            tipl::out() << "FDR converged after " << permutation_done << " permutations" << std::endl;
+            converged = true;
+        }
+    }
+    fdr_inc_snapshot = fdr_inc;
+    fdr_dec_snapshot = fdr_dec;
+}
+
+void group_connectometry_analysis::update_FDR(void)
 {
     double sum_inc_null = 0.0;
     double sum_dec_null = 0.0;
@@ -607,7 +1113,10 @@ void group_connectometry_analysis::generate_report(std::string& output)
     if(!report.empty())
     {
         html_report << "<h2>Connectometry analysis</h2>" << std::endl;
-        html_report << "<p>" << report.c_str() << "</p>" << std::endl;
+        html_report << "<p>" << report.c_str();
+        if(converged)
+            html_report << " The permutation stopped after " << permutation_done << " permutations as the FDR estimates converged.";
+        html_report << "</p>" << std::endl;
     }
 
     std::string fdr_result_pos,fdr_result_neg;
@@ -8,6 +8,7 @@
 class fib_data;
 class tracking;
 class TractModel;
+struct ThreadData;
 
 
 
@@ -28,9 +29,15 @@ public:// database information
     float fiber_threshold;
 public:
     void calculate_adjusted_qa(stat_model& info);
-    void calculate_spm(connectometry_result& data,stat_model& info);
+    void calculate_spm(connectometry_result& data,stat_model& info,unsigned int thread_count = 1)
+    {
+        calculate_spm(std::vector<connectometry_result*>{&data},std::vector<const stat_model*>{&info},thread_count);
+    }
+    void calculate_spm(const std::vector<connectometry_result*>& data,const std::vector<const stat_model*>& info,
+                       unsigned int thread_count = 1);
 private: // single subject analysis result
-    int run_track(std::shared_ptr<tracking_data> fib,std::vector<std::vector<float> >& track,
+    std::shared_ptr<ThreadData> new_tracking_thread(void);
+    int run_track(ThreadData& tracking_thread,std::shared_ptr<tracking_data> fib,std::vector<std::vector<float> >& track,
                   unsigned int seed_count,unsigned int random_seed,unsigned int thread_count = 1);
 public:// for FDR analysis
     std::vector<std::thread> threads;
@@ -41,6 +48,7 @@ public:// for FDR analysis
     std::vector<float> fdr_inc,fdr_dec;
     unsigned int prog;// 0~100
     bool terminated = false;
+    bool converged = false;
     bool no_tractogram = false;
     unsigned int preprocess = 0;
 public:
@@ -49,12 +57,13 @@ public:
 public:
     std::string output_file_name;
     int seed_count;
-    std::mutex lock_add_tracks,lock_add_null_track;
+    std::mutex lock_add_tracks,lock_add_null_track; // lock_add_tracks also guards the length histograms
     std::shared_ptr<TractModel> inc_track,dec_track,pos_null_corr_track,neg_null_corr_track;
 public:// Multiple regression
     std::shared_ptr<stat_model> model;
     std::shared_ptr<connectometry_result> spm_map;
     std::vector<std::vector<float> > population_value_adjusted;
+    std::vector<std::vector<uint16_t> > population_rank; // only for study_feature != 0, empty for populations with tied values
     std::string index_name,hypothesis_inc,hypothesis_dec;
     float t_threshold;
     unsigned int length_threshold_voxels;
@@ -67,6 +76,29 @@ public:// Multiple regression
     void calculate_FDR(void);
     void save_result(void);
     void generate_report(std::string& output);
+public:// streaming FDR
+    bool discard_null_tracts = false; // keep only the length histograms of null tracts
+    unsigned int fdr_snapshot_interval = 0; // permutations between FDR snapshots, 0: no snapshot
+    float fdr_converge = 0.0f; // stop when FDR changes less than this between snapshots
+    unsigned int permutation_done = 0;
+    std::vector<float> fdr_inc_snapshot,fdr_dec_snapshot;
+private:
+    void update_FDR(void);
+    void snapshot_FDR(void);
+public:// checkpoint
+    std::string checkpoint_file_name; // empty: no checkpoint
+    unsigned int checkpoint_interval = 10; // permutations between checkpoints
+    std::vector<unsigned char> permutation_completed;
+public:// distributed permutation
+    unsigned int permutation_begin = 0,permutation_end = 0; // 0: run to the last permutation
+    unsigned int fixed_seed_count = 0; // 0: determined by a preliminary run
+    std::vector<std::string> partial_file_names; // merge these checkpoints instead of running permutations
+private:
+    std::string checkpoint_parameter,checkpoint_generation;
+    std::mutex lock_checkpoint; // serializes checkpoint writers
+    std::vector<std::pair<std::shared_ptr<TractModel>,std::string> > checkpoint_tracks(void);
+    bool save_checkpoint(bool wait);
+    bool load_checkpoint(const std::string& file_name,std::string& generation);
 };
 
 #endif // VBC_DATABASE_H
@@ -285,71 +285,140 @@ bool find_bval_bvec(const char* file_name,QString& bval,QString& bvec)
 bool get_bval_bvec(const std::string& bval_file,const std::string& bvec_file,size_t dwi_count,
                    std::vector<double>& bvals,std::vector<double>& bvecs,
                    std::string& error_msg);
-bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool need_bvalbvec)
+// decode a 4D NIFTI into one contiguous uint16 buffer in a single pass. volumes holding integers
+// within the uint16 range (the usual case) are stored exactly as decoded, and only the others keep
+// a float copy until the range of the whole series is known. the final conversion truncates v*scale
+// with the series scale, as the float path did.
+bool load_4d_nii(const char* file_name,tipl::image<4,unsigned short>& dwi,tipl::vector<3>& vs)
 {
-    tipl::vector<3,float> vs;
-    std::vector<tipl::image<3> > dwi_data;
+    tipl::io::gz_nifti nii;
+    nii.input_stream->buffer_all = true;
+    if(!nii.load_from_file(file_name))
+    {
+        src_error_msg = nii.error_msg;
+        return false;
+    }
+    if(nii.dim(4) <= 1)
+    {
+        src_error_msg = "not a 4D nifti file";
+        return false;
+    }
+    nii.get_voxel_size(vs);
+    std::vector<float> volume_max(nii.dim(4));
+    std::vector<tipl::image<3> > float_volume(nii.dim(4));
+    tipl::image<3> data;
+    for(unsigned int index = 0;index < nii.dim(4);++index)
     {
-        tipl::io::gz_nifti nii;
-        nii.input_stream->buffer_all = true;
-        if(!nii.load_from_file(file_name))
+        if(!nii.toLPS(data))
         {
-            src_error_msg = nii.error_msg;
+            src_error_msg = "Incomplete file. Only ";
+            src_error_msg += std::to_string(index+1);
+            src_error_msg += " of ";
+            src_error_msg += std::to_string(nii.dim(4));
+            src_error_msg += " DWI are found.";
             return false;
         }
-        if(nii.dim(4) <= 1)
+        if(index == 0)
         {
-            src_error_msg = "not a 4D nifti file";
-            return false;
+            tipl::shape<4> dim;
+            std::copy(data.shape().begin(),data.shape().end(),dim.begin());
+            dim[3] = nii.dim(4);
+            dwi.resize(dim);
         }
-        dwi_data.resize(nii.dim(4));
-        nii.get_voxel_size(vs);
-        // check data range
-        for(unsigned int index = 0;index < nii.dim(4);++index)
+        std::replace_if(data.begin(),data.end(),[](float v){return std::isnan(v) || std::isinf(v) || v < 0.0f;},0.0f);
+        volume_max[index] = tipl::max_value(data);
+        if(volume_max[index] > float(std::numeric_limits<unsigned short>::max()) ||
+           std::any_of(data.begin(),data.end(),[](float v){return v != std::floor(v);}))
         {
-            tipl::image<3> data;
-            if(!nii.toLPS(data))
-            {
-                src_error_msg = "Incomplete file. Only ";
-                src_error_msg += std::to_string(index+1);
-                src_error_msg += " of ";
-                src_error_msg += std::to_string(nii.dim(4));
-                src_error_msg += " DWI are found.";
-                return false;
-            }
-            std::replace_if(data.begin(),data.end(),[](float v){return std::isnan(v) || std::isinf(v) || v < 0.0f;},0.0f);
-            dwi_data[index].swap(data);
+            float_volume[index].swap(data);
+            continue;
         }
+        std::copy(data.begin(),data.end(),dwi.begin() + long(index*data.size()));
     }
 
-
     // if the imaging value is larger than 16-bit integer, then scale it.
+    float scale = 1.0f;
     {
-        float max_value = 0.0f;
-        for(unsigned int index = 0;index < dwi_data.size();++index)
-            max_value = std::max<float>(max_value,tipl::max_value(dwi_data[index]));
+        float max_value = *std::max_element(volume_max.begin(),volume_max.end());
         if(max_value > float(std::numeric_limits<unsigned short>::max()-1))
-        {
-            float scale = float(std::numeric_limits<unsigned short>::max()-1)/max_value;
-            tipl::par_for(dwi_data.size(),[&](unsigned int index){
-                dwi_data[index] *= scale;
-            });
-        }
+            scale = float(std::numeric_limits<unsigned short>::max()-1)/max_value;
         if(max_value < 256.0f)
         {
             tipl::out() << "The maximum singal is only " << max_value << std::endl;
-            float scale = 1.0f;
             while(max_value*scale*32.0f < std::numeric_limits<unsigned short>::max())
                 scale *= 32.0f;
             if(scale != 1.0f)
-            {
                 tipl::out() << "scaling the image by " << scale << std::endl;
-                tipl::par_for(dwi_data.size(),[&](unsigned int index){
-                    dwi_data[index] *= scale;
-                });
-            }
         }
     }
+    size_t volume_size = dwi.size()/volume_max.size();
+    tipl::par_for(volume_max.size(),[&](size_t index)
+    {
+        auto ptr = dwi.begin() + long(index*volume_size);
+        if(!float_volume[index].empty())
+        {
+            for(size_t i = 0;i < volume_size;++i)
+                ptr[i] = (unsigned short)(float_volume[index][i]*scale);
+            tipl::image<3>().swap(float_volume[index]);
+            return;
+        }
+        if(scale != 1.0f)
+            for(size_t i = 0;i < volume_size;++i)
+                ptr[i] = (unsigned short)(float(ptr[i])*scale);
+    });
+    return true;
+}
+bool load_4d_nii(const char* file_name,tipl::image<4,unsigned short>& dwi,tipl::vector<3>& vs,
+                 std::vector<float>& bvalues,std::vector<tipl::vector<3> >& bvecs,bool need_bvalbvec)
+{
+    if(!load_4d_nii(file_name,dwi,vs))
+        return false;
+    size_t dwi_count = dwi.shape()[3];
+    std::vector<double> bvals,bvecs_;
+    QString bval_name,bvec_name;
+    if(find_bval_bvec(file_name,bval_name,bvec_name))
+    {
+        tipl::out() << "found bval and bvec file for " << file_name;
+        std::string error_msg;
+        if(!get_bval_bvec(bval_name.toStdString(),bvec_name.toStdString(),dwi_count,bvals,bvecs_,error_msg))
+        {
+            src_error_msg = error_msg;
+            tipl::out() << error_msg;
+        }
+    }
+    else
+        src_error_msg = "cannot find bval/bvec file";
+
+    if(need_bvalbvec && bvals.empty())
+        return false;
+
+    bvalues.clear();
+    bvecs.clear();
+    bvalues.resize(dwi_count);
+    bvecs.resize(dwi_count);
+    if(!bvals.empty())
+        for(size_t index = 0;index < dwi_count;++index)
+        {
+            bvalues[index] = float(bvals[index]);
+            bvecs[index] = tipl::vector<3>(float(bvecs_[index*3]),float(bvecs_[index*3+1]),float(bvecs_[index*3+2]));
+            bvecs[index].normalize();
+            if(bvalues[index] < 100)
+            {
+                bvalues[index] = 0;
+                bvecs[index] = tipl::vector<3>(0,0,0);
+            }
+        }
+    return true;
+}
+bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool need_bvalbvec)
+{
+    tipl::vector<3,float> vs;
+    tipl::image<4,unsigned short> dwi;
+    std::vector<float> bvalues;
+    std::vector<tipl::vector<3> > bvecs;
+    if(!load_4d_nii(file_name,dwi,vs,bvalues,bvecs,need_bvalbvec))
+        return false;
+
     tipl::image<4,float> grad_dev;
     if(QFileInfo(QFileInfo(file_name).absolutePath() + "/grad_dev.nii.gz").exists())
     {
@@ -372,47 +441,18 @@ bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >&
         }
     }
 
-    std::vector<double> bvals,bvecs;
-    QString bval_name,bvec_name;
-    if(find_bval_bvec(file_name,bval_name,bvec_name))
-    {
-        tipl::out() << "found bval and bvec file for " << file_name;
-        std::string error_msg;
-        if(!get_bval_bvec(bval_name.toStdString(),bvec_name.toStdString(),dwi_data.size(),bvals,bvecs,error_msg))
-        {
-            src_error_msg = error_msg;
-            tipl::out() << error_msg;
-        }
-    }
-    else
-        src_error_msg = "cannot find bval/bvec file";
-
-    if(need_bvalbvec && bvals.empty())
-        return false;
-
-    for(unsigned int index = 0;index < dwi_data.size();++index)
+    tipl::shape<3> dim(dwi.width(),dwi.height(),dwi.depth());
+    for(unsigned int index = 0;index < bvalues.size();++index)
     {
         std::shared_ptr<DwiHeader> new_file(new DwiHeader);
-        tipl::image<3> data;
-        data.swap(dwi_data[index]);
-        new_file->image = data;
+        new_file->image.resize(dim);
+        std::copy(dwi.begin() + long(index*dim.size()),dwi.begin() + long((index+1)*dim.size()),new_file->image.begin());
         new_file->file_name = file_name;
         new_file->file_name += ":";
         new_file->file_name += std::to_string(index);
         new_file->voxel_size = vs;
-        if(!bvals.empty())
-        {
-            new_file->bvalue = float(bvals[index]);
-            new_file->bvec[0] = float(bvecs[index*3]);
-            new_file->bvec[1] = float(bvecs[index*3+1]);
-            new_file->bvec[2] = float(bvecs[index*3+2]);
-            new_file->bvec.normalize();
-            if(new_file->bvalue < 100)
-            {
-                new_file->bvalue = 0;
-                new_file->bvec = tipl::vector<3>(0,0,0);
-            }
-        }
+        new_file->bvalue = bvalues[index];
+        new_file->bvec = bvecs[index];
         if(index == 0 && !grad_dev.empty())
             new_file->grad_dev.swap(grad_dev);
         if(index == 0 && !mask.empty())
@@ -534,6 +574,30 @@ bool load_4d_2dseq(const char* file_name,std::vector<std::shared_ptr<DwiHeader>
     return true;
 }
 
+// open DICOM files with a pool of readers, a chunk at a time to bound memory use,
+// and pass them to assemble() in the original file order. failed files are passed as nullptr.
+bool open_dwi_in_order(const QStringList& file_list,tipl::progress& prog,
+                       std::function<bool(int,std::shared_ptr<DwiHeader>)> assemble)
+{
+    const int chunk_size = int(std::max<unsigned int>(1,std::thread::hardware_concurrency()))*4;
+    for(int from = 0;prog(from,file_list.size());from += chunk_size)
+    {
+        std::vector<std::string> names;
+        for(int i = from;i < file_list.size() && i < from+chunk_size;++i)
+            names.push_back(file_list[i].toStdString());
+        std::vector<std::shared_ptr<DwiHeader> > opened(names.size());
+        tipl::par_for(names.size(),[&](size_t i)
+        {
+            auto dwi = std::make_shared<DwiHeader>();
+            if(dwi->open(names[i].c_str()))
+                opened[i] = dwi;
+        });
+        for(size_t i = 0;i < opened.size();++i)
+            if(!assemble(from+int(i),opened[i]))
+                return false;
+    }
+    return !prog.aborted();
+}
 bool load_multiple_slice_dicom(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
 {
     tipl::io::dicom dicom_header;// multiple frame image
@@ -613,10 +677,10 @@ bool load_multiple_slice_dicom(QStringList file_list,std::vector<std::shared_ptr
         }
     }
     tipl::progress prog("reading multiple slices DWI");
-    for (unsigned int index = 0,b_index = dwi_files.size(),slice_index = 0;prog(index,file_list.size());++index)
+    unsigned int b_index = dwi_files.size(),slice_index = 0;
+    return open_dwi_in_order(file_list,prog,[&](int index,std::shared_ptr<DwiHeader> dwi)
     {
-        std::shared_ptr<DwiHeader> dwi(new DwiHeader);
-        if(!dwi->open(file_list[index].toStdString().c_str()))
+        if(!dwi)
             return false;
         if(slice_index == 0)
         {
@@ -650,8 +714,8 @@ bool load_multiple_slice_dicom(QStringList file_list,std::vector<std::shared_ptr
                 ++slice_index;
             }
         }
-    }
-    return !prog.aborted();
+        return true;
+    });
 }
 void scale_image_buf_to_uint16(std::vector<tipl::image<3> >& image_buf)
 {
@@ -974,15 +1038,15 @@ bool parse_dwi(QStringList file_list,
     if(dicom_header.is_mosaic || geo[2] != 1)
     {
         tipl::out()  << "handled as Siemens mosaic or multiframe";
-        for (unsigned int index = 0;prog(index,file_list.size());++index)
+        return open_dwi_in_order(file_list,prog,[&](int index,std::shared_ptr<DwiHeader> new_file)
         {
-            std::shared_ptr<DwiHeader> new_file(new DwiHeader);
-            if (!new_file->open(file_list[index].toStdString().c_str()))
-                continue;
-            new_file->file_name = file_list[index].toStdString().c_str();
-            dwi_files.push_back(new_file);
-        }
-        return !prog.aborted() && !dwi_files.empty();
+            if(new_file)
+            {
+                new_file->file_name = file_list[index].toStdString().c_str();
+                dwi_files.push_back(new_file);
+            }
+            return true;
+        }) && !dwi_files.empty();
     }
     if(geo[2] == 1)
     {
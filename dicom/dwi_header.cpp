@@ -1,4 +1,6 @@
 #include <QFileInfo>
+#include <fstream>
+#include <future>
 #include <sstream>
 #include <string>
 #include "dwi_header.hpp"
@@ -344,6 +346,107 @@ bool DwiHeader::has_b_table(std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
             return true;
     return false;
 }
+// gzip output stream that deflates 1 MB blocks in parallel, as pigz does. Each block is raw-deflated
+// with the preceding 32 KB as its dictionary and ends with a sync flush (the last one with Z_FINISH),
+// so the blocks concatenate into a single gzip member. The block CRCs are merged with crc32_combine.
+class parallel_gz_ostream{
+    std::ofstream out;
+    std::vector<unsigned char> pending,dictionary;
+    uLong crc = crc32(0L,Z_NULL,0);
+    uint32_t total_size = 0; // ISIZE is the input size modulo 2^32
+    bool failed = false;
+    static constexpr size_t block_size = 1 << 20;
+    static constexpr size_t window_size = 1 << 15;
+    size_t thread_count = std::max<size_t>(1,std::thread::hardware_concurrency());
+    void deflate_pending(bool last)
+    {
+        size_t block_count = std::max<size_t>(1,(pending.size()+block_size-1)/block_size);
+        std::vector<std::vector<unsigned char> > output(block_count);
+        std::vector<uLong> block_crc(block_count);
+        std::vector<char> block_failed(block_count);
+        tipl::par_for(block_count,[&](size_t b)
+        {
+            size_t from = b*block_size;
+            size_t size = std::min(block_size,pending.size()-from);
+            const unsigned char* in = pending.data()+from;
+            z_stream zs = {};
+            if(deflateInit2(&zs,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                block_failed[b] = 1;
+                return;
+            }
+            if(b)
+                deflateSetDictionary(&zs,in-std::min(from,window_size),uInt(std::min(from,window_size)));
+            else
+            if(!dictionary.empty())
+                deflateSetDictionary(&zs,dictionary.data(),uInt(dictionary.size()));
+            auto& o = output[b];
+            o.resize(deflateBound(&zs,uLong(size))+64);
+            zs.next_in = const_cast<Bytef*>(in);
+            zs.avail_in = uInt(size);
+            zs.next_out = o.data();
+            zs.avail_out = uInt(o.size());
+            int ret = deflate(&zs,(last && b+1 == block_count) ? Z_FINISH : Z_SYNC_FLUSH);
+            if((last && b+1 == block_count) ? ret != Z_STREAM_END : (ret != Z_OK || !zs.avail_out))
+                block_failed[b] = 1;
+            o.resize(o.size()-zs.avail_out);
+            deflateEnd(&zs);
+            block_crc[b] = crc32(crc32(0L,Z_NULL,0),in,uInt(size));
+        },thread_count);
+        for(size_t b = 0;b < block_count;++b)
+        {
+            if(block_failed[b])
+                failed = true;
+            out.write(reinterpret_cast<const char*>(output[b].data()),std::streamsize(output[b].size()));
+            crc = crc32_combine(crc,block_crc[b],z_off_t(std::min(block_size,pending.size()-b*block_size)));
+        }
+        total_size += uint32_t(pending.size());
+        if(pending.size() >= window_size)
+            dictionary.assign(pending.end()-window_size,pending.end());
+        else
+        {
+            dictionary.insert(dictionary.end(),pending.begin(),pending.end());
+            if(dictionary.size() > window_size)
+                dictionary.erase(dictionary.begin(),dictionary.end()-window_size);
+        }
+        pending.clear();
+    }
+public:
+    ~parallel_gz_ostream(void){close();}
+    bool open(const char* file_name)
+    {
+        out.open(file_name,std::ios::binary);
+        const unsigned char header[10] = {0x1f,0x8b,8,0,0,0,0,0,0,0xff};
+        out.write(reinterpret_cast<const char*>(header),10);
+        return good();
+    }
+    void write(const void* buf,size_t size)
+    {
+        auto ptr = reinterpret_cast<const unsigned char*>(buf);
+        pending.insert(pending.end(),ptr,ptr+size);
+        if(pending.size() >= block_size*thread_count)
+            deflate_pending(false);
+    }
+    void flush(void){}
+    void close(void)
+    {
+        if(!out.is_open())
+            return;
+        deflate_pending(true);
+        unsigned char trailer[8];
+        for(int i = 0;i < 4;++i)
+        {
+            trailer[i] = uint8_t(crc >> (i*8));
+            trailer[i+4] = uint8_t(total_size >> (i*8));
+        }
+        out.write(reinterpret_cast<const char*>(trailer),8);
+        out.close();
+    }
+    bool good(void) const{return !failed && out.good();}
+    bool operator!(void) const{return !good();}
+    operator bool() const{return good();}
+};
+
 // upsampling 1: upsampling 2: downsampling
 extern std::string src_error_msg;
 bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,
@@ -366,7 +469,8 @@ bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHe
     }
     auto temp_file = std::string(di_file) + ".tmp.gz";
     {
-        tipl::io::gz_mat_write write_mat(temp_file.c_str());
+        // deflate is the bottleneck of a large SRC, so it runs on all cores
+        tipl::io::mat_write_base<parallel_gz_ostream> write_mat(temp_file.c_str());
         if(!write_mat)
         {
             src_error_msg = "cannot output file to ";
@@ -435,34 +539,56 @@ bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHe
             write_mat.write("mask",dwi_files[0]->mask,dwi_files[0]->mask.plane_size());
 
         //store images
-        for (unsigned int index = 0;prog(index,(unsigned int)(dwi_files.size()));++index)
         {
-            std::ostringstream name;
-            tipl::image<3,unsigned short> buffer;
-            const unsigned short* ptr = 0;
-            name << "image" << index;
-            ptr = (const unsigned short*)dwi_files[index]->begin();
-            if(upsampling)
+            // resampling runs in worker threads one batch ahead of the writer, which
+            // keeps the original volume order in the output
+            const size_t batch_size = std::max<size_t>(1,std::thread::hardware_concurrency());
+            auto resample_batch = [&](size_t from)
             {
-                buffer.resize(geo);
-                std::copy(ptr,ptr+geo.size(),buffer.begin());
-                if(upsampling == 1)
-                    tipl::upsampling(buffer);
-                if(upsampling == 2)
-                    tipl::downsampling(buffer);
-                if(upsampling == 3)
+                std::vector<tipl::image<3,unsigned short> > batch(std::min(batch_size,dwi_files.size()-from));
+                tipl::par_for(batch.size(),[&](size_t i)
                 {
-                    tipl::upsampling(buffer);
-                    tipl::upsampling(buffer);
-                }
-                if(upsampling == 4)
+                    auto& buffer = batch[i];
+                    buffer = dwi_files[from+i]->image;
+                    if(upsampling == 1)
+                        tipl::upsampling(buffer);
+                    if(upsampling == 2)
+                        tipl::downsampling(buffer);
+                    if(upsampling == 3)
+                    {
+                        tipl::upsampling(buffer);
+                        tipl::upsampling(buffer);
+                    }
+                    if(upsampling == 4)
+                    {
+                        tipl::downsampling(buffer);
+                        tipl::downsampling(buffer);
+                    }
+                });
+                return batch;
+            };
+            std::vector<tipl::image<3,unsigned short> > batch;
+            std::future<std::vector<tipl::image<3,unsigned short> > > next_batch;
+            if(upsampling)
+                next_batch = std::async(std::launch::async,resample_batch,0);
+            for (unsigned int index = 0;prog(index,(unsigned int)(dwi_files.size()));++index)
+            {
+                std::ostringstream name;
+                const unsigned short* ptr = 0;
+                name << "image" << index;
+                ptr = (const unsigned short*)dwi_files[index]->begin();
+                if(upsampling)
                 {
-                    tipl::downsampling(buffer);
-                    tipl::downsampling(buffer);
+                    if(index % batch_size == 0)
+                    {
+                        batch = next_batch.get();
+                        if(index+batch_size < dwi_files.size())
+                            next_batch = std::async(std::launch::async,resample_batch,index+batch_size);
+                    }
+                    ptr = (const unsigned short*)&*batch[index % batch_size].begin();
                 }
-                ptr = (const unsigned short*)&*buffer.begin();
+                write_mat.write(name.str().c_str(),ptr,output_dim.plane_size(),output_dim.depth());
             }
-            write_mat.write(name.str().c_str(),ptr,output_dim.plane_size(),output_dim.depth());
         }
 
         if(prog.aborted())
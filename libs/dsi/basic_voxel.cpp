@@ -1,3 +1,4 @@
+#include <chrono>
 #include "basic_voxel.hpp"
 #include "image_model.hpp"
 
@@ -15,6 +16,10 @@ bool Voxel::init(void)
         voxel_data.resize(thread_count);
         for (unsigned int index = 0; index < thread_count; ++index)
         {
+            voxel_data[index].block_odf.clear();
+            voxel_data[index].block_tensor.clear();
+            voxel_data[index].qsdr_kernel.clear();
+            voxel_data[index].qsdr_count = 0;
             voxel_data[index].space.resize(bvalues.size());
             voxel_data[index].odf.resize(ti.half_vertices_count);
             voxel_data[index].fa.resize(max_fiber_number);
@@ -22,6 +27,7 @@ bool Voxel::init(void)
             voxel_data[index].dir.resize(max_fiber_number);
         }
     }
+    scheme_trans.clear();
     for (unsigned int index = 0; prog(index,process_list.size()); ++index)
     {
         tipl::out() << process_name[index];
@@ -94,53 +100,104 @@ bool Voxel::run_hist(void)
 
     std::vector<tipl::vector<2,int> > from_list;
     std::vector<tipl::vector<2,int> > to_list;
-    for(int y = 0;y < hist_image.height(); y+= crop_size)
-        for(int x = 0;x < hist_image.width(); x+= crop_size)
+    auto shape = hist_shape();
+    for(int y = 0;y < shape.height(); y+= crop_size)
+        for(int x = 0;x < shape.width(); x+= crop_size)
         {
             tipl::vector<2,int> from(x-int(margin),y-int(margin)),to(x+int(crop_size+margin),y+int(crop_size+margin));
             if(from[0] < 0)
                 from[0] = 0;
             if(from[1] < 0)
                 from[1] = 0;
-            if(to[0] >= hist_image.width())
-                to[0] = hist_image.width()-1;
-            if(to[1] >= hist_image.height())
-                to[1] = hist_image.height()-1;
+            if(to[0] >= shape.width())
+                to[0] = shape.width()-1;
+            if(to[1] >= shape.height())
+                to[1] = shape.height()-1;
             from_list.push_back(from);
             to_list.push_back(to);
         }
 
+    // one tile (plus margin) in flight per thread
     size_t p = 0;
+    std::atomic<bool> read_failed(false);
     tipl::par_for(from_list.size(),[&](size_t i,size_t thread_id)
     {
         prog(p++,from_list.size());
-        if(prog.aborted())
+        if(prog.aborted() || read_failed)
             return;
         hist_data[thread_id].init();
         hist_data[thread_id].from = from_list[i];
         hist_data[thread_id].to = to_list[i];
         for (unsigned int j = 0; j < process_list.size(); ++j)
+        {
             process_list[j]->run_hist(*this,hist_data[thread_id]);
+            if(hist_data[thread_id].read_failed)
+            {
+                read_failed = true;
+                return;
+            }
+        }
     });
+    if(read_failed)
+    {
+        hist_error_msg = "cannot read image tiles from the slide";
+        return false;
+    }
     return !prog.aborted();
 }
-bool Voxel::run(const char* title)
+void Voxel::prepare_voxel_major(void)
 {
-    tipl::progress prog(title,true);
-    size_t total_size = 0;
-    tipl::par_for(thread_count,[&](size_t thread_id)
+    release_voxel_major();
+    // dwi_data is in the native space while qsdr runs on the template mask
+    if(!voxel_major_dwi || qsdr || dwi_data.empty() || mask.size() != dim.size())
+        return;
+    std::vector<size_t> masked;
+    for(size_t index = 0;index < mask.size();++index)
+        if(mask[index])
+            masked.push_back(index);
+    size_t q_count = dwi_data.size();
+    size_t required_mb = (masked.size()*q_count*sizeof(unsigned short) + mask.size()*sizeof(uint32_t)) >> 20;
+    if(required_mb > voxel_major_max_mb || masked.size() > std::numeric_limits<uint32_t>::max())
     {
-        for(size_t voxel_index = thread_id;voxel_index < mask.size() && prog(total_size++,mask.size());voxel_index += thread_count)
+        tipl::out() << "voxel-major dwi requires " << required_mb << " MB, above the " << voxel_major_max_mb
+                    << " MB limit. use volume-major dwi" << std::endl;
+        return;
+    }
+    auto begin = std::chrono::steady_clock::now();
+    try{
+        dwi_voxel_major.resize(masked.size()*q_count);
+        voxel_major_pos.resize(mask.size());
+    }
+    catch(...)
+    {
+        release_voxel_major();
+        tipl::out() << "insufficient memory for voxel-major dwi. use volume-major dwi" << std::endl;
+        return;
+    }
+    // transpose tile by tile so that the written rows stay in cache while each volume is read
+    const size_t tile = 1024;
+    tipl::par_for((masked.size()+tile-1)/tile,[&](size_t t)
+    {
+        size_t from = t*tile,to = std::min(masked.size(),from+tile);
+        for(size_t v = from;v < to;++v)
+            voxel_major_pos[masked[v]] = uint32_t(v);
+        for(size_t i = 0;i < q_count;++i)
         {
-            if(!mask[voxel_index])
-                continue;
-            voxel_data[thread_id].init();
-            voxel_data[thread_id].voxel_index = voxel_index;
-            for (size_t index = 0; index < process_list.size(); ++index)
-                process_list[index]->run(*this,voxel_data[thread_id]);
+            auto dwi = dwi_data[i];
+            auto out = dwi_voxel_major.begin() + int64_t(from*q_count+i);
+            for(size_t v = from;v < to;++v,out += int64_t(q_count))
+                *out = dwi[masked[v]];
         }
     },thread_count);
-    return !prog.aborted();
+    tipl::out() << "voxel-major dwi: " << masked.size() << " voxels x " << q_count << " signals, "
+                << required_mb << " MB, transposed in "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()-begin).count()
+                << " ms" << std::endl;
+}
+void Voxel::release_voxel_major(void)
+{
+    std::vector<unsigned short>().swap(dwi_voxel_major);
+    std::vector<uint32_t>().swap(voxel_major_pos);
 }
 
 
@@ -1,6 +1,8 @@
 #ifndef BASIC_VOXEL_HPP
 #define BASIC_VOXEL_HPP
 #include <string>
+#include <atomic>
+#include <functional>
 #include "zlib.h"
 #include "TIPL/tipl.hpp"
 #include "tessellated_icosahedron.hpp"
@@ -18,6 +20,7 @@ public:
     virtual bool needed(Voxel&) {return true;}
     virtual void init(Voxel&) {}
     virtual void run(Voxel&, VoxelData&) {}
+    virtual void run_block(Voxel&, VoxelData&) {} // called for each block of voxels (VoxelData::block) before run()
     virtual void run_hist(Voxel&,HistData&) {}
     virtual void end(Voxel&,tipl::io::gz_mat_write&) {}    
     virtual ~BaseProcess(void) {}
@@ -38,6 +41,20 @@ struct VoxelData
     float min_odf;
     tipl::matrix<3,3,float> jacobian;
     tipl::matrix<3,3,float> grad_dev;
+    // block reconstruction
+    std::vector<size_t> block;      // masked voxels processed together
+    size_t block_pos = 0;           // position of voxel_index in block
+    std::vector<float> block_space; // block.size()-by-dwi count
+    std::vector<float> block_odf;   // block.size()-by-odf size
+    // per-thread scratch reused across voxels
+    std::vector<float> space_buf,odf_buf;
+    std::vector<double> signal_buf;
+    std::vector<double> block_tensor; // DTI fit of the block, 6 per voxel, NaN if not fitted
+    std::vector<std::pair<float,unsigned short> > peaks;
+    // QSDR kernel shared by consecutive voxels with similar Jacobian
+    std::vector<float> qsdr_kernel;
+    tipl::matrix<3,3,float> qsdr_kernel_jacobian;
+    size_t qsdr_count = 0;
 
     void init(void)
     {
@@ -52,15 +69,17 @@ struct HistData
 public:
     tipl::image<2,unsigned char> I,I_mask;
     tipl::vector<2,int> from,to;
+    bool read_failed = false;
 public:
-    enum {dx = 0,dy = 1,dxx = 2,dyy = 3,dxy = 4};
+    enum {dx = 0,dy = 1,dxx = 2,dyy = 3,dxy = 4,tmp = 5};
     std::vector<tipl::image<2> > other_maps;
+    tipl::image<3> fa;
+    tipl::image<3,tipl::vector<3> > dir;
 public:
+    // buffers are kept between tiles so that each thread reuses its allocation
     void init(void)
     {
-        I.clear();
-        I_mask.clear();
-        other_maps.clear();
+        read_failed = false;
         other_maps.resize(10);
     }
 };
@@ -71,6 +90,7 @@ class Voxel
 private:
     std::vector<std::shared_ptr<BaseProcess> > process_list;
     std::vector<std::string> process_name;
+    std::vector<BaseProcess*> process_slot; // one for each type in init_process, nullptr if not needed
 public:
     tipl::shape<3> dim;
     tipl::vector<3> vs;
@@ -81,10 +101,24 @@ public:
     std::vector<const unsigned short*> dwi_data;
     std::vector<tipl::vector<3,float> > bvectors;
     std::vector<float> bvalues;
+public: // optional voxel-major copy of dwi_data for the masked voxels
+    bool voxel_major_dwi = false;
+    size_t voxel_major_max_mb = 4096; // fall back to dwi_data if the copy needs more memory
+    std::vector<unsigned short> dwi_voxel_major;
+    std::vector<uint32_t> voxel_major_pos;
+    // dwi_data.size() contiguous signals of a masked voxel, or nullptr if not prepared
+    const unsigned short* dwi_at(size_t voxel_index) const
+    {
+        return dwi_voxel_major.empty() ? nullptr : &dwi_voxel_major[size_t(voxel_major_pos[voxel_index])*dwi_data.size()];
+    }
+    void prepare_voxel_major(void);
+    void release_voxel_major(void);
 
     std::string report,steps;
     std::ostringstream recon_report, step_report;
     unsigned int thread_count = std::thread::hardware_concurrency();
+    unsigned int block_size = 0; // number of voxels reconstructed together (GQI), 0: voxel by voxel. opt-in until benchmarked
+    bool motion_coarse_skip = false; // motion correction: skip full-resolution refinement when the half-resolution level barely moved
     void load_from_src(ImageModel& image_model);
 public:
     unsigned char method_id;
@@ -110,6 +144,12 @@ public:
     }
 public:
     tipl::image<2,unsigned char> hist_image;
+    // whole-slide images too large for memory are left on disk and read tile by tile (from,to) with hist_tile_reader
+    tipl::shape<2> hist_tile_shape;
+    std::function<bool(const tipl::vector<2,int>&,const tipl::vector<2,int>&,tipl::image<2,unsigned char>&)> hist_tile_reader;
+    size_t hist_max_pixels = size_t(1) << 30; // larger images are read tile by tile
+    std::string hist_error_msg;
+    tipl::shape<2> hist_shape(void) const {return hist_image.empty() ? hist_tile_shape : hist_image.shape();}
     unsigned int hist_downsampling = 4;
     unsigned int hist_raw_smoothing = 4;
     unsigned int hist_tensor_smoothing = 8;
@@ -124,6 +164,7 @@ public://used in GQI
 public://used in GQI
     std::vector<unsigned int> shell;
     bool scheme_balance = false;
+    std::vector<float> scheme_trans; // from BalanceScheme: balanced-by-acquired signal transformation
 public:// manual alignment used in QSDR
     bool manual_alignment = false;
     tipl::affine_transform<float> qsdr_arg;
@@ -131,6 +172,9 @@ public:// used in QSDR
     tipl::matrix<4,4> trans_to_mni;
     size_t template_id = 0;
     bool qsdr = false;
+    bool qsdr_exact_kernel = true;          // evaluate sinc for every kernel entry, false: tabulated sinc and Jacobian reuse
+    float qsdr_jacobian_tolerance = 0.002f; // relative Jacobian difference allowed to reuse a kernel
+    unsigned int qsdr_kernel_check = 0;     // compare every n-th voxel with the exact kernel, 0: no check
     tipl::vector<3,int> csf_pos1,csf_pos2,csf_pos3,csf_pos4;
     float R2;
     float qsdr_reso = 1.0f;
@@ -165,11 +209,14 @@ public:
         if(new_process->needed(*this))
         {
             process_list.push_back(new_process);
+            process_slot.push_back(new_process.get());
             process_name.push_back(std::string());
             std::istringstream in(typeid(T).name());
             while(in)
                 in >> process_name.back();
         }
+        else
+            process_slot.push_back(nullptr);
         if constexpr (sizeof...(Ts) > 0) {
             add_process<Ts...>();
         }
@@ -178,13 +225,83 @@ public:
     bool init_process(void)
     {
         process_list.clear();
+        process_slot.clear();
         process_name.clear();
         add_process<Ts...>();
         return init();
     }
+    // call fun with each needed process cast to its own type in Ts
+    template<typename ...Ts,typename Fun>
+    void for_each_process(Fun&& fun)
+    {
+        size_t slot = 0;
+        ((process_slot[slot] ? fun(static_cast<Ts*>(process_slot[slot])) : void(),++slot),...);
+    }
 public:
     bool init(void);
-    bool run(const char* title);
+    template<typename ...Ts>
+    bool run(const char* title)
+    {
+        prepare_voxel_major();
+        tipl::progress prog(title,true);
+        // contiguous slabs of voxels, empty slabs skipped, handed out to threads in order
+        const size_t slab_size = 4096;
+        std::vector<size_t> slab_count((mask.size()+slab_size-1)/slab_size);
+        tipl::par_for(slab_count.size(),[&](size_t s)
+        {
+            auto from = mask.begin()+int64_t(s*slab_size);
+            slab_count[s] = size_t(std::count_if(from,from+int64_t(std::min(slab_size,mask.size()-s*slab_size)),
+                                          [](unsigned char m){return m != 0;}));
+        },thread_count);
+        std::vector<size_t> slabs;
+        size_t total_count = 0;
+        for(size_t s = 0;s < slab_count.size();++s)
+            if(slab_count[s])
+            {
+                slabs.push_back(s);
+                total_count += slab_count[s];
+            }
+        std::atomic<size_t> next_slab(0),finished_count(0);
+        size_t cur_block_size = std::max<size_t>(1,block_size);
+        tipl::par_for(thread_count,[&](size_t thread_id)
+        {
+            auto& data = voxel_data[thread_id];
+            for(size_t s = next_slab++;s < slabs.size() && prog(finished_count.load(),total_count);s = next_slab++)
+            {
+                size_t to = std::min(mask.size(),(slabs[s]+1)*slab_size);
+                for(size_t voxel_index = slabs[s]*slab_size;voxel_index < to;)
+                {
+                    // gather the next block of masked voxels
+                    data.block.clear();
+                    for(;voxel_index < to && data.block.size() < cur_block_size;++voxel_index)
+                        if(mask[voxel_index])
+                            data.block.push_back(voxel_index);
+                    if(data.block.empty())
+                        continue;
+                    // qualified calls: the process types are known here, no virtual dispatch per voxel
+                    if(block_size)
+                        for_each_process<Ts...>([&](auto* p)
+                        {
+                            using T = std::remove_pointer_t<decltype(p)>;
+                            p->T::run_block(*this,data);
+                        });
+                    for(data.block_pos = 0;data.block_pos < data.block.size();++data.block_pos)
+                    {
+                        data.init();
+                        data.voxel_index = data.block[data.block_pos];
+                        for_each_process<Ts...>([&](auto* p)
+                        {
+                            using T = std::remove_pointer_t<decltype(p)>;
+                            p->T::run(*this,data);
+                        });
+                    }
+                }
+                finished_count += slab_count[slabs[s]];
+            }
+        },thread_count);
+        release_voxel_major();
+        return !prog.aborted();
+    }
     bool run_hist(void);
     bool end(tipl::io::gz_mat_write& writer);
     BaseProcess* get(unsigned int index);
@@ -59,7 +59,7 @@ bool ImageModel::reconstruction_hist(void)
             EigenAnalysis>() ||
        !voxel.run_hist())
     {
-        error_msg = "reconstruction canceled";
+        error_msg = voxel.hist_error_msg.empty() ? "reconstruction canceled" : voxel.hist_error_msg;
         return false;
     }
 
@@ -298,6 +298,7 @@ const char* odf_average(const char* out_name,std::vector<std::string>& file_name
                 ti.vertices_count = uint16_t(ti.vertices.size());
                 ti.half_vertices_count = ti.vertices_count/2;
                 ti.fold = uint16_t(std::floor(std::sqrt((ti.vertices_count-2)/10.0)+0.5));
+                ti.reset_dir_table();
                 mni = fib.trans_to_mni;
                 fib.get_index_list(other_metrics_name);
                  // remove odf metrics generated from averaged ODFs
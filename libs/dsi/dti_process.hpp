@@ -3,6 +3,57 @@
 #include <cmath>
 #include "basic_voxel.hpp"
 
+// eigenvalues (descending) and the first eigenvector of a symmetric 3-by-3 matrix in closed form
+// returns false for (nearly) repeated largest eigenvalues, which are left to the iterative solver
+inline bool eigen_sym3_analytic(const double* A,double* V,double* d)
+{
+    double a = A[0],b = A[4],c = A[8],xy = A[1],xz = A[2],yz = A[5];
+    double p1 = xy*xy+xz*xz+yz*yz;
+    double q = (a+b+c)/3.0;
+    double p2 = (a-q)*(a-q)+(b-q)*(b-q)+(c-q)*(c-q)+2.0*p1;
+    double p = std::sqrt(p2/6.0);
+    if(!(p > 1.0e-12*std::max<double>(1.0,std::fabs(q))))
+        return false;
+    double ba = (a-q)/p,bb = (b-q)/p,bc = (c-q)/p,bxy = xy/p,bxz = xz/p,byz = yz/p;
+    double r = 0.5*(ba*(bb*bc-byz*byz)-bxy*(bxy*bc-byz*bxz)+bxz*(bxy*byz-bb*bxz));
+    double phi = std::acos(std::min<double>(1.0,std::max<double>(-1.0,r)))/3.0;
+    d[0] = q+2.0*p*std::cos(phi);
+    d[2] = q+2.0*p*std::cos(phi+2.0*3.14159265358979323846/3.0);
+    d[1] = 3.0*q-d[0]-d[2];
+    if(d[0]-d[1] <= 1.0e-6*std::fabs(d[0]))
+        return false;
+    // the eigenvector is orthogonal to the rows of A-d0*I: take the largest of their cross products
+    double r0[3] = {a-d[0],xy,xz},r1[3] = {xy,b-d[0],yz},r2[3] = {xz,yz,c-d[0]};
+    auto cross = [](const double* u,const double* v,double* w)
+    {
+        w[0] = u[1]*v[2]-u[2]*v[1];
+        w[1] = u[2]*v[0]-u[0]*v[2];
+        w[2] = u[0]*v[1]-u[1]*v[0];
+        return w[0]*w[0]+w[1]*w[1]+w[2]*w[2];
+    };
+    double c01[3],c02[3],c12[3];
+    double n01 = cross(r0,r1,c01),n02 = cross(r0,r2,c02),n12 = cross(r1,r2,c12);
+    const double* best = c01;
+    double n = n01;
+    if(n02 > n)
+    {
+        best = c02;
+        n = n02;
+    }
+    if(n12 > n)
+    {
+        best = c12;
+        n = n12;
+    }
+    if(!(n > 0.0))
+        return false;
+    n = std::sqrt(n);
+    V[0] = best[0]/n;
+    V[1] = best[1]/n;
+    V[2] = best[2]/n;
+    return true;
+}
+
 class Dwi2Tensor : public BaseProcess
 {
     std::vector<float> ad,rd,rd1,rd2,md,txx,txy,txz,tyy,tyz,tzz,ha;
@@ -24,6 +75,7 @@ private:
     std::vector<double> Kt;
     unsigned int b_count;
     std::vector<size_t> b_location;
+    std::vector<double> iKtKKt; // iKtK[0]^-1*Kt, 6-by-b_count, applied to a block of voxels at once
 public:
     virtual void init(Voxel& voxel)
     {
@@ -112,13 +164,86 @@ public:
             }
             tipl::mat::lu_decomposition(iKtK[i].begin(),iKtK_pivot[i].begin(),tipl::shape<2>(6,6));
         }
+        iKtKKt.resize(6*b_count);
+        for(unsigned int j = 0;j < b_count;++j)
+        {
+            double col[6],x[6];
+            for(unsigned int k = 0;k < 6;++k)
+                col[k] = Kt[k*b_count+j];
+            if(!tipl::mat::lu_solve(iKtK[0].begin(),iKtK_pivot[0].begin(),col,x,tipl::shape<2>(6,6)))
+            {
+                iKtKKt.clear();
+                break;
+            }
+            for(unsigned int k = 0;k < 6;++k)
+                iKtKKt[k*b_count+j] = x[k];
+        }
+    }
+    virtual void run_block(Voxel& voxel, VoxelData& data)
+    {
+        data.block_tensor.clear();
+        // qsdr signals are interpolated per voxel
+        if(voxel.fib_fa.empty() || voxel.qsdr || iKtKKt.empty() || !b_count)
+            return;
+        size_t n = data.block.size();
+        auto& signal = data.signal_buf;
+        signal.resize(n*b_count);
+        data.block_tensor.resize(n*6);
+        // log signals of the block, b_count per voxel
+        for (size_t i = 0;i < b_count;++i)
+        {
+            if(!voxel.dwi_voxel_major.empty())
+                for (size_t v = 0;v < n;++v)
+                    signal[v*b_count+i] = double(voxel.dwi_at(data.block[v])[b_location[i]]);
+            else
+            {
+                auto dwi = voxel.dwi_data[b_location[i]];
+                for (size_t v = 0;v < n;++v)
+                    signal[v*b_count+i] = double(dwi[data.block[v]]);
+            }
+        }
+        for (auto& s : signal)
+            s = std::log(std::max<double>(1.0,s));
+        for (size_t v = 0;v < n;++v)
+        {
+            double* s = &signal[v*b_count];
+            double* tensor_param = &data.block_tensor[v*6];
+            double b0 = double(voxel.dwi_voxel_major.empty() ? voxel.dwi_data[0][data.block[v]] : voxel.dwi_at(data.block[v])[0]);
+            double logs0 = std::max<double>(std::log(std::max<double>(1.0,b0)),*std::max_element(s,s+b_count));
+            if(logs0 == 0.0)
+            {
+                tensor_param[0] = std::numeric_limits<double>::quiet_NaN();
+                continue;
+            }
+            for (size_t i = 0;i < b_count;++i)
+                s[i] = std::max<double>(0.0,logs0-s[i]);
+            for (size_t k = 0;k < 6;++k)
+                tensor_param[k] = tipl::vec::dot(s,s+b_count,&iKtKKt[k*b_count]);
+        }
     }
 public:
     virtual void run(Voxel& voxel, VoxelData& data)
     {
         if(voxel.fib_fa.empty())
             return;
-        std::vector<double> signal(b_count);
+        double KtS[6],tensor_param[6];
+        double tensor[9];
+        double V[9],d[3];
+        unsigned int tensor_index[9] = {0,3,4,3,1,5,4,5,2};
+        // fitted with the block, unless the tensor is not positive definite
+        if(!data.block_tensor.empty() && !std::isnan(data.block_tensor[data.block_pos*6]))
+        {
+            const double* param = &data.block_tensor[data.block_pos*6];
+            for (unsigned int index = 0; index < 9; ++index)
+                tensor[index] = param[tensor_index[index]];
+            if(eigen_sym3_analytic(tensor,V,d) && d[0] > 0.0 && d[1] > 0.0 && d[2] > 0.0)
+            {
+                output(voxel,data,tensor,V,d);
+                return;
+            }
+        }
+        auto& signal = data.signal_buf;
+        signal.resize(b_count);
         {
             double logs0 = std::log(std::max<double>(1.0,double(data.space.front())));
             for (size_t i = 0;i < b_count;++i)
@@ -130,15 +255,11 @@ public:
                 signal[i] = std::max<double>(0.0,logs0-signal[i]);
         }
         //  Kt S = Kt K D
-        double KtS[6],tensor_param[6];
-        double tensor[9];
-        double V[9],d[3];
         tipl::mat::product(Kt.begin(),signal.begin(),KtS,tipl::shape<2>(6,b_count),tipl::shape<2>(b_count,1));
         for(unsigned int i = 0;i < iKtK.size();++i)
         {
             if(!tipl::mat::lu_solve(iKtK[i].begin(),iKtK_pivot[i].begin(),KtS,tensor_param,tipl::shape<2>(6,6)))
                 continue;
-            unsigned int tensor_index[9] = {0,3,4,3,1,5,4,5,2};
             for (unsigned int index = 0; index < 9; ++index)
                 tensor[index] = tensor_param[tensor_index[index]];
             tipl::mat::eigen_decomposition_sym(tensor,V,d,tipl::dim<3,3>());
@@ -149,7 +270,10 @@ public:
         d[0] = std::max(0.0,d[0]);
         d[1] = std::max(0.0,d[1]);
         d[2] = std::max(0.0,d[2]);
-
+        output(voxel,data,tensor,V,d);
+    }
+    void output(Voxel& voxel,VoxelData& data,const double* tensor,const double* V,const double* d)
+    {
         std::copy(V,V+3,voxel.fib_dir[data.voxel_index].begin());
         voxel.fib_fa[data.voxel_index] = get_fa(float(d[0]),float(d[1]),float(d[2]));
 
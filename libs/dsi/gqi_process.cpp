@@ -30,43 +30,201 @@ void GQI_Recon::calculate_q_vec_t(Voxel& voxel)
         q_vectors_time[index] *= sigma;
     }
 }
+void GQI_Recon::calculate_block_kernel(Voxel& voxel)
+{
+    // odf = sinc_ql*half_sphere*scheme_trans*raw, combined into one odf_size-by-raw_q matrix
+    unsigned int odf_size = voxel.ti.half_vertices_count;
+    unsigned int q_count = uint32_t(voxel.bvalues.size());
+    unsigned int raw_q_count = uint32_t(voxel.dwi_data.size());
+    std::vector<float> sinc(sinc_ql);
+    if(dsi_half_sphere)
+        for (unsigned int j = 0; j < odf_size; ++j)
+            sinc[j*q_count] *= 0.5f;
+    if(voxel.scheme_trans.empty())
+    {
+        if(q_count != raw_q_count)
+            return;
+        block_kernel.swap(sinc);
+        return;
+    }
+    if(voxel.scheme_trans.size() != size_t(q_count)*size_t(raw_q_count))
+        return;
+    block_kernel.resize(size_t(odf_size)*size_t(raw_q_count));
+    tipl::mat::product(sinc.begin(),voxel.scheme_trans.begin(),block_kernel.begin(),
+                       tipl::shape<2>(odf_size,q_count),tipl::shape<2>(q_count,raw_q_count));
+}
+void GQI_Recon::calculate_kernel_table(Voxel& voxel)
+{
+    // |q_vectors_time*from| is bounded by |q_vectors_time| because from is normalized
+    float max_x = 0.0f;
+    for (const auto& q : q_vectors_time)
+        max_x = std::max<float>(max_x,float(q.length()));
+    kernel_table.resize(size_t(max_x*kernel_table_scale)+2);
+    for (size_t i = 0; i < kernel_table.size(); ++i)
+    {
+        float x = float(i)/kernel_table_scale;
+        kernel_table[i] = voxel.r2_weighted ? base_function(x) : sinc_pi_imp(x);
+    }
+}
+void GQI_Recon::calculate_qsdr_kernel(Voxel& voxel,const tipl::matrix<3,3,float>& jacobian,std::vector<float>& kernel,bool exact) const
+{
+    size_t odf_size = voxel.ti.half_vertices_count;
+    size_t q_count = q_vectors_time.size();
+    kernel.resize(odf_size*q_count);
+    for (size_t j = 0,index = 0; j < odf_size; ++j)
+    {
+        tipl::vector<3,float> from(voxel.ti.vertices[j]);
+        from.rotate(jacobian);
+        from.normalize();
+        for (size_t i = 0; i < q_count; ++i,++index)
+        {
+            float x = q_vectors_time[i]*from;
+            if(!exact)
+            {
+                // both functions are even: linear interpolation of the table
+                float t = std::fabs(x)*kernel_table_scale;
+                if(t < float(kernel_table.size()-1))
+                {
+                    size_t k = size_t(t);
+                    kernel[index] = kernel_table[k]+(kernel_table[k+1]-kernel_table[k])*(t-float(k));
+                    continue;
+                }
+            }
+            kernel[index] = voxel.r2_weighted ? base_function(x) : sinc_pi_imp(x);
+        }
+    }
+}
 void GQI_Recon::init(Voxel& voxel)
 {
+    block_kernel.clear();
+    check_count = 0;
+    check_error_sum = 0.0;
+    check_error_max = 0.0f;
+    dsi_half_sphere = voxel.shell.size() > 4 && voxel.shell[1] - voxel.shell[0] <= 3;
     if(voxel.qsdr)
+    {
         calculate_q_vec_t(voxel);
+        calculate_kernel_table(voxel);
+    }
     else
+    {
         calculate_sinc_ql(voxel);
-    dsi_half_sphere = voxel.shell.size() > 4 && voxel.shell[1] - voxel.shell[0] <= 3;
+        if(voxel.block_size)
+            calculate_block_kernel(voxel);
+    }
+}
+
+void GQI_Recon::run_block(Voxel& voxel, VoxelData& data)
+{
+    data.block_odf.clear();
+    if(block_kernel.empty())
+        return;
+    size_t q_count = voxel.dwi_data.size();
+    size_t odf_size = block_kernel.size()/q_count;
+    size_t n = data.block.size();
+    // gather the block as a voxel-by-q matrix
+    data.block_space.resize(n*q_count);
+    if(!voxel.dwi_voxel_major.empty())
+    {
+        for (size_t v = 0; v < n; ++v)
+        {
+            auto dwi = voxel.dwi_at(data.block[v]);
+            std::copy(dwi,dwi+q_count,data.block_space.begin()+int64_t(v*q_count));
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < q_count; ++i)
+        {
+            auto dwi = voxel.dwi_data[i];
+            for (size_t v = 0,pos = i; v < n; ++v,pos += q_count)
+                data.block_space[pos] = dwi[data.block[v]];
+        }
+    }
+    // block_odf = block_space*block_kernel^T, kernel rows taken in chunks that stay in cache across the block
+    data.block_odf.resize(n*odf_size);
+    const size_t chunk = 32;
+    for (size_t j0 = 0; j0 < odf_size; j0 += chunk)
+    {
+        size_t j1 = std::min(odf_size,j0+chunk);
+        for (size_t v = 0; v < n; ++v)
+        {
+            auto s = data.block_space.begin() + int64_t(v*q_count);
+            auto out = data.block_odf.begin() + int64_t(v*odf_size);
+            for (size_t j = j0; j < j1; ++j)
+            {
+                auto k = block_kernel.begin() + int64_t(j*q_count);
+                out[int64_t(j)] = tipl::vec::dot(k,k+int64_t(q_count),s);
+            }
+        }
+    }
 }
 
 void GQI_Recon::run(Voxel& voxel, VoxelData& data)
 {
     if(dsi_half_sphere)
         data.space[0] *= 0.5f;
+    if(!data.block_odf.empty())
+    {
+        auto odf = data.block_odf.begin() + int64_t(data.block_pos*data.odf.size());
+        std::copy(odf,odf+int64_t(data.odf.size()),data.odf.begin());
+        return;
+    }
     // add rotation from QSDR or gradient nonlinearity
     if(voxel.qsdr)
     {
-        std::vector<float> sinc_ql_(data.odf.size()*data.space.size());
-        for (unsigned int j = 0,index = 0; j < data.odf.size(); ++j)
+        bool reuse = false;
+        if(!data.qsdr_kernel.empty())
         {
-            tipl::vector<3,float> from(voxel.ti.vertices[j]);
-            from.rotate(data.jacobian);
-            from.normalize();
-            if(voxel.r2_weighted)
-                for (unsigned int i = 0; i < data.space.size(); ++i,++index)
-                    sinc_ql_[index] = base_function(q_vectors_time[i]*from);
-            else
-                for (unsigned int i = 0; i < data.space.size(); ++i,++index)
-                    sinc_ql_[index] = sinc_pi_imp(q_vectors_time[i]*from);
-
+            float max_j = 0.0f,max_dif = 0.0f;
+            for (unsigned int k = 0; k < 9; ++k)
+            {
+                max_j = std::max<float>(max_j,std::fabs(data.qsdr_kernel_jacobian[k]));
+                max_dif = std::max<float>(max_dif,std::fabs(data.jacobian[k]-data.qsdr_kernel_jacobian[k]));
+            }
+            reuse = max_dif <= (voxel.qsdr_exact_kernel ? 0.0f : voxel.qsdr_jacobian_tolerance*max_j);
         }
-        tipl::mat::vector_product(&*sinc_ql_.begin(),&*data.space.begin(),&*data.odf.begin(),
+        if(!reuse)
+        {
+            calculate_qsdr_kernel(voxel,data.jacobian,data.qsdr_kernel,voxel.qsdr_exact_kernel);
+            data.qsdr_kernel_jacobian = data.jacobian;
+        }
+        tipl::mat::vector_product(&*data.qsdr_kernel.begin(),&*data.space.begin(),&*data.odf.begin(),
                                       tipl::shape<2>(uint32_t(data.odf.size()),uint32_t(data.space.size())));
+        if(voxel.qsdr_kernel_check && (++data.qsdr_count) % voxel.qsdr_kernel_check == 0)
+            check_qsdr_kernel(voxel,data);
     }
     else
         tipl::mat::vector_product(&*sinc_ql.begin(),&*data.space.begin(),&*data.odf.begin(),
                                 tipl::shape<2>(uint32_t(data.odf.size()),uint32_t(data.space.size())));
 }
 
+void GQI_Recon::check_qsdr_kernel(Voxel& voxel,VoxelData& data)
+{
+    std::vector<float> kernel,odf(data.odf.size());
+    calculate_qsdr_kernel(voxel,data.jacobian,kernel,true);
+    tipl::mat::vector_product(&*kernel.begin(),&*data.space.begin(),&*odf.begin(),
+                                  tipl::shape<2>(uint32_t(odf.size()),uint32_t(data.space.size())));
+    float sum2 = 0.0f,dif2 = 0.0f;
+    for (size_t j = 0; j < odf.size(); ++j)
+    {
+        sum2 += odf[j]*odf[j];
+        dif2 += (odf[j]-data.odf[j])*(odf[j]-data.odf[j]);
+    }
+    if(sum2 == 0.0f)
+        return;
+    float error = std::sqrt(dif2/sum2);
+    std::lock_guard<std::mutex> lock(check_mutex);
+    ++check_count;
+    check_error_sum += double(error);
+    check_error_max = std::max<float>(check_error_max,error);
+}
 
-
+void GQI_Recon::end(Voxel& voxel,tipl::io::gz_mat_write&)
+{
+    if(!check_count)
+        return;
+    tipl::out() << "QSDR kernel check on " << check_count << " voxels: mean ODF error " << 100.0*check_error_sum/double(check_count)
+                << "%, max ODF error " << 100.0f*check_error_max << "%" << std::endl;
+    voxel.step_report << "[Step T2b(1)][QSDR kernel error]=" << 100.0*check_error_sum/double(check_count) << std::endl;
+}
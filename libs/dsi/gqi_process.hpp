@@ -2,6 +2,7 @@
 #define DDI_PROCESS_HPP
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <mutex>
 #include "basic_process.hpp"
 #include "basic_voxel.hpp"
 #include "image_model.hpp"
@@ -42,12 +43,27 @@ public:
     std::vector<tipl::vector<3,float> > q_vectors_time;
     std::vector<float> sinc_ql;
     bool dsi_half_sphere = false;
+private:
+    std::vector<float> block_kernel; // sinc_ql combined with scheme balance, applied to the acquired signals
+private: // QSDR
+    std::vector<float> kernel_table; // sinc or base function tabulated over |x|
+    float kernel_table_scale = 1024.0f;
+    std::mutex check_mutex;
+    size_t check_count = 0;
+    double check_error_sum = 0.0;
+    float check_error_max = 0.0f;
 private:
     void calculate_sinc_ql(Voxel& voxel);
     void calculate_q_vec_t(Voxel& voxel);
+    void calculate_block_kernel(Voxel& voxel);
+    void calculate_kernel_table(Voxel& voxel);
+    void calculate_qsdr_kernel(Voxel& voxel,const tipl::matrix<3,3,float>& jacobian,std::vector<float>& kernel,bool exact) const;
+    void check_qsdr_kernel(Voxel& voxel,VoxelData& data);
 public:
     virtual void init(Voxel& voxel) override;
+    virtual void run_block(Voxel& voxel, VoxelData& data) override;
     virtual void run(Voxel& voxel, VoxelData& data) override;
+    virtual void end(Voxel& voxel,tipl::io::gz_mat_write& mat_writer) override;
 };
 
 class HGQI_Recon  : public BaseProcess
@@ -196,7 +212,10 @@ public:
             data.space[0] = 0;
         }
         from.run(voxel,data);
-        std::vector<float> hardi_data(dwi.size()),tmp(dwi.size());
+        auto& hardi_data = data.space_buf;
+        auto& tmp = data.odf_buf;
+        hardi_data.resize(dwi.size());
+        tmp.resize(dwi.size());
         tipl::mat::vector_product(&*Rt.begin(),&*data.odf.begin(),&*tmp.begin(),tipl::shape<2>(dwi.size(),dwi.size()));
         tipl::mat::lu_solve(&*A.begin(),&*piv.begin(),&*tmp.begin(),&*hardi_data.begin(),tipl::shape<2>(dwi.size(),dwi.size()));
         for(unsigned int index = 0;index < dwi.size();++index)
@@ -325,14 +344,13 @@ public:
     virtual void run(Voxel&, VoxelData& data)
     {
         float last_value = 0;
-        std::vector<float> rdi_values(rdi_weightings.size());
+        data.rdi.resize(rdi_weightings.size());
         for(unsigned int index = 0;index < rdi_weightings.size();++index)
         {
             // force incremental
-            rdi_values[index] = std::max<float>(last_value,tipl::vec::dot(rdi_weightings[index].begin(),rdi_weightings[index].end(),data.space.begin()));
-            last_value = rdi_values[index];
+            data.rdi[index] = std::max<float>(last_value,tipl::vec::dot(rdi_weightings[index].begin(),rdi_weightings[index].end(),data.space.begin()));
+            last_value = data.rdi[index];
         }
-        data.rdi.swap(rdi_values);
     }
 };
 #endif//DDI_PROCESS_HPP
@@ -7,15 +7,25 @@ class ReadImages : public BaseProcess{
 
     virtual void run_hist(Voxel& voxel,HistData& hist)
     {
-        // crop from original image
-        tipl::crop(voxel.hist_image,hist.I,hist.from,hist.to);
+        // crop from original image, or read the tile from the file
+        if(!voxel.hist_image.empty())
+            tipl::crop(voxel.hist_image,hist.I,hist.from,hist.to);
+        else
+        if(!voxel.hist_tile_reader || !voxel.hist_tile_reader(hist.from,hist.to,hist.I))
+        {
+            tipl::out() << "cannot read image tile at " << hist.from[0] << "," << hist.from[1] << std::endl;
+            hist.read_failed = true;
+            return;
+        }
 
         // translate mask from downsampled space to the original space
         auto& mask = hist.I_mask;
         mask.resize(hist.I.shape());
+        std::fill(mask.begin(),mask.end(),0);
 
-        float rx = float(voxel.mask.width()-1)/float(voxel.hist_image.width()-1);
-        float ry = float(voxel.mask.height()-1)/float(voxel.hist_image.height()-1);
+        auto shape = voxel.hist_shape();
+        float rx = float(voxel.mask.width()-1)/float(shape.width()-1);
+        float ry = float(voxel.mask.height()-1)/float(shape.height()-1);
 
         for(tipl::pixel_index<2> p(mask.shape());p < mask.size();++p)
         {
@@ -36,12 +46,8 @@ class CalculateGradient : public BaseProcess{
     {
         for(unsigned int i = 0;i < voxel.hist_raw_smoothing;++i)
             tipl::filter::gaussian(hist.I);
-        tipl::image<2> dx,dy;
-        tipl::gradient_2x(hist.I,dx);
-        tipl::gradient_2y(hist.I,dy);
-
-        hist.other_maps[HistData::dx] = std::move(dx);
-        hist.other_maps[HistData::dy] = std::move(dy);
+        tipl::gradient_2x(hist.I,hist.other_maps[HistData::dx]);
+        tipl::gradient_2y(hist.I,hist.other_maps[HistData::dy]);
     }
 };
 
@@ -49,9 +55,9 @@ class CalculateStructuralTensor : public BaseProcess{
 
     virtual void run_hist(Voxel& voxel,HistData& hist)
     {
-        tipl::image<2> dxx,dyy,dxy;
-        dxx = std::move(hist.other_maps[HistData::dx]);
-        dyy = std::move(hist.other_maps[HistData::dy]);
+        auto& dxx = hist.other_maps[HistData::dx];
+        auto& dyy = hist.other_maps[HistData::dy];
+        auto& dxy = hist.other_maps[HistData::tmp];
         dxy = dxx;
         dxy *= dyy;
         tipl::square(dxx);
@@ -112,8 +118,8 @@ public:
     virtual void init(Voxel& voxel)
     {
         new_vs = voxel.vs;
-        new_dim[0] = voxel.hist_image.width();
-        new_dim[1] = voxel.hist_image.height();
+        new_dim[0] = voxel.hist_shape().width();
+        new_dim[1] = voxel.hist_shape().height();
         new_dim[2] = 1;
         for(unsigned int i = 0;i < voxel.hist_downsampling;++i)
         {
@@ -126,13 +132,16 @@ public:
     }
     virtual void run_hist(Voxel& voxel,HistData& hist)
     {
-        tipl::image<2> dxx,dyy,dxy;
-        dxx = std::move(hist.other_maps[HistData::dxx]);
-        dyy = std::move(hist.other_maps[HistData::dyy]);
-        dxy = std::move(hist.other_maps[HistData::dxy]);
-
-        tipl::image<3> hist_fa_sub({dxx.width(),dxx.height(),1});
-        tipl::image<3,tipl::vector<3> > hist_dir_sub({dxx.width(),dxx.height(),1});
+        const auto& dxx = hist.other_maps[HistData::dxx];
+        const auto& dyy = hist.other_maps[HistData::dyy];
+        const auto& dxy = hist.other_maps[HistData::dxy];
+
+        auto& hist_fa_sub = hist.fa;
+        auto& hist_dir_sub = hist.dir;
+        hist_fa_sub.resize({dxx.width(),dxx.height(),1});
+        hist_dir_sub.resize({dxx.width(),dxx.height(),1});
+        std::fill(hist_fa_sub.begin(),hist_fa_sub.end(),0.0f);
+        std::fill(hist_dir_sub.begin(),hist_dir_sub.end(),tipl::vector<3>());
 
         for(size_t i = 0;i < dxx.size();++i)
             if(dxx[i] != 0.0f)
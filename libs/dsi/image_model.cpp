@@ -3,6 +3,7 @@
 #include <QInputDialog>
 #include <QDateTime>
 #include <QImage>
+#include <QImageReader>
 #include <QProcess>
 #include "image_model.hpp"
 #include "odf_process.hpp"
@@ -12,9 +13,13 @@
 #include "tracking/region/Regions.h"
 #include <filesystem>
 #include "reg.hpp"
+#ifdef DSI_STUDIO_USE_LIBTIFF
+#include <tiffio.h>
+#endif
 
 extern std::string src_error_msg;
-bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool need_bvalbvec);
+bool load_4d_nii(const char* file_name,tipl::image<4,unsigned short>& dwi,tipl::vector<3>& vs,
+                 std::vector<float>& bvalues,std::vector<tipl::vector<3> >& bvecs,bool need_bvalbvec);
 
 void ImageModel::draw_mask(tipl::color_image& buffer,int position)
 {
@@ -667,37 +672,43 @@ bool ImageModel::command(std::string cmd,std::string param)
     }
     if(cmd == "[Step T2][Edit][Image flip x]")
     {
-        flip_dwi(0);
+        if(!flip_dwi(0))
+            return false;
         voxel.steps += cmd+"\n";
         return true;
     }
     if(cmd == "[Step T2][Edit][Image flip y]")
     {
-        flip_dwi(1);
+        if(!flip_dwi(1))
+            return false;
         voxel.steps += cmd+"\n";
         return true;
     }
     if(cmd == "[Step T2][Edit][Image flip z]")
     {
-        flip_dwi(2);
+        if(!flip_dwi(2))
+            return false;
         voxel.steps += cmd+"\n";
         return true;
     }
     if(cmd == "[Step T2][Edit][Image swap xy]")
     {
-        flip_dwi(3);
+        if(!flip_dwi(3))
+            return false;
         voxel.steps += cmd+"\n";
         return true;
     }
     if(cmd == "[Step T2][Edit][Image swap yz]")
     {
-        flip_dwi(4);
+        if(!flip_dwi(4))
+            return false;
         voxel.steps += cmd+"\n";
         return true;
     }
     if(cmd == "[Step T2][Edit][Image swap xz]")
     {
-        flip_dwi(5);
+        if(!flip_dwi(5))
+            return false;
         voxel.steps += cmd+"\n";
         return true;
     }
@@ -841,8 +852,13 @@ void ImageModel::swap_b_table(unsigned char dim)
 
 // 0: x  1: y  2: z
 // 3: xy 4: yz 5: xz
-void ImageModel::flip_dwi(unsigned char type)
+bool ImageModel::flip_dwi(unsigned char type)
 {
+    if(voxel.is_histology && voxel.hist_image.empty())
+    {
+        error_msg = "flipping is not supported for images read tile by tile";
+        return false;
+    }
     if(type < 3)
         flip_b_table(type);
     else
@@ -862,6 +878,7 @@ void ImageModel::flip_dwi(unsigned char type)
         });
     }
     voxel.dim = voxel.mask.shape();
+    return true;
 }
 
 tipl::matrix<3,3,float> get_inv_rotation(const Voxel& voxel,const tipl::transformation_matrix<double>& T)
@@ -1053,26 +1070,79 @@ bool ImageModel::correct_motion(void)
     };
 
 
+    // volumes are registered in parallel, one per CPU thread unless GPUs are used. the thread count is
+    // passed to each loop, tipl::available_thread_count is left to the registration itself
+    unsigned int thread_count = has_cuda ? uint32_t(gpu_count*4) : std::max<unsigned int>(1,tipl::available_thread_count);
+    tipl::vector<3> coarse_vs(voxel.vs);
+    coarse_vs *= 2.0f;
+    // motion_coarse_skip: register at half resolution first, and refine at full resolution only if the coarse level moved the estimate
+    auto skip_refinement = [&](const tipl::affine_transform<float>& arg,const tipl::affine_transform<float>& arg0)
+    {
+        float shift = float((tipl::vector<3>(arg.translocation)-tipl::vector<3>(arg0.translocation)).length());
+        float rotation = float((tipl::vector<3>(arg.rotation)-tipl::vector<3>(arg0.rotation)).length());
+        return voxel.motion_coarse_skip && shift < 0.05f*voxel.vs[0] && rotation < 0.001f;
+    };
+    auto register_dwi = [&](const tipl::image<3>& from,const tipl::image<3>& to,tipl::affine_transform<float>& arg)
+    {
+        bool terminated = false;
+        auto arg0 = arg;
+        if(voxel.motion_coarse_skip)
+        {
+            tipl::image<3> from_(from),to_(to);
+            tipl::downsample_with_padding(from_);
+            tipl::downsample_with_padding(to_);
+            linear_with_mi_refine(from_,coarse_vs,to_,coarse_vs,arg,tipl::reg::rigid_body,terminated);
+            if(skip_refinement(arg,arg0))
+                return;
+        }
+        linear_with_mi_refine(from,voxel.vs,to,voxel.vs,arg,tipl::reg::rigid_body,terminated);
+    };
+
     std::vector<tipl::affine_transform<float> > args(src_bvalues.size());
     {
         tipl::image<3> from(dwi_at(0));
         preproc(from);
+        // warm starts come from a sequential half-resolution pass in acquisition order, each volume
+        // starting from the previous one, so that the result does not depend on thread timing
+        std::vector<tipl::affine_transform<float> > coarse_args(src_bvalues.size());
+        {
+            tipl::progress prog("estimate motion at half resolution...");
+            tipl::image<3> from_(from);
+            tipl::downsample_with_padding(from_);
+            for(size_t i = 1;prog(i,src_bvalues.size());++i)
+            {
+                coarse_args[i] = coarse_args[i-1];
+                tipl::image<3> to(dwi_at(i));
+                preproc(to);
+                tipl::downsample_with_padding(to);
+                bool terminated = false;
+                linear_with_mi_refine(from_,coarse_vs,to,coarse_vs,coarse_args[i],tipl::reg::rigid_body,terminated);
+            }
+            if(prog.aborted())
+            {
+                error_msg = "aborted";
+                return false;
+            }
+        }
         tipl::progress prog("apply motion correction...");
-        unsigned int p = 0;
-        tipl::par_for(src_bvalues.size(),[&](int i)
+        std::atomic<unsigned int> p(0);
+        tipl::par_for(src_bvalues.size(),[&](size_t i)
         {
             prog(++p,src_bvalues.size());
             if(prog.aborted() || !i)
                 return;
-            args[i] = args[i-1];
-            tipl::image<3> to(dwi_at(i));
-            preproc(to);
-            bool terminated = false;
-            linear_with_mi_refine(from,voxel.vs,to,voxel.vs,args[i],tipl::reg::rigid_body,terminated);
+            args[i] = coarse_args[i];
+            if(!skip_refinement(coarse_args[i],coarse_args[i-1]))
+            {
+                tipl::image<3> to(dwi_at(i));
+                preproc(to);
+                bool terminated = false;
+                linear_with_mi_refine(from,voxel.vs,to,voxel.vs,args[i],tipl::reg::rigid_body,terminated);
+            }
             tipl::out() << "dwi (" << i+1 << "/" << src_bvalues.size() << ")" <<
                          " shift=" << tipl::vector<3>(args[i].translocation) <<
                          " rotation=" << tipl::vector<3>(args[i].rotation) << std::endl;
-        },has_cuda ? gpu_count*4 : 1);
+        },thread_count);
 
         if(prog.aborted())
         {
@@ -1081,13 +1151,33 @@ bool ImageModel::correct_motion(void)
         }
     }
 
+    // resample each volume once with its first-pass estimate and share it across targets, if memory allows
+    std::vector<tipl::image<3> > resampled;
+    if(src_bvalues.size()*dwi.size()*sizeof(float) <= (size_t(4) << 30))
+    {
+        tipl::progress prog("resample volumes...");
+        resampled.resize(src_bvalues.size());
+        std::atomic<unsigned int> p(0);
+        tipl::par_for(src_bvalues.size(),[&](size_t j)
+        {
+            prog(++p,src_bvalues.size());
+            resampled[j].resize(dwi.shape());
+            tipl::resample<tipl::interpolation::cubic>(dwi_at(j),resampled[j],
+                tipl::transformation_matrix<double>(args[j],voxel.dim,voxel.vs,voxel.dim,voxel.vs));
+        },thread_count);
+        if(prog.aborted())
+        {
+            error_msg = "aborted";
+            return false;
+        }
+    }
 
     // get ndc list
     std::vector<tipl::affine_transform<float> > new_args(args);
 
     {
         tipl::progress prog("estimate and registering...");
-        unsigned int p = 0;
+        std::atomic<unsigned int> p(0);
         tipl::par_for(src_bvalues.size(),[&](int i)
         {
             prog(++p,src_bvalues.size());
@@ -1117,8 +1207,13 @@ bool ImageModel::correct_motion(void)
                     continue;
                 if(dis_list[j] <= min_dis)
                 {
+                    if(!resampled.empty())
+                    {
+                        from += resampled[j];
+                        continue;
+                    }
                     tipl::image<3> from_(dwi.shape());
-                    tipl::resample_mt<tipl::interpolation::cubic>(dwi_at(j),from_,
+                    tipl::resample<tipl::interpolation::cubic>(dwi_at(j),from_,
                         tipl::transformation_matrix<double>(args[j],voxel.dim,voxel.vs,voxel.dim,voxel.vs));
                     from += from_;
                 }
@@ -1127,13 +1222,12 @@ bool ImageModel::correct_motion(void)
             preproc(from);
             preproc(to);
 
-            bool terminated = false;
-            linear_with_mi_refine(from,voxel.vs,to,voxel.vs,new_args[i],tipl::reg::rigid_body,terminated);
+            register_dwi(from,to,new_args[i]);
             tipl::out() << "dwi (" << i+1 << "/" << src_bvalues.size() << ") = "
                       << " shift=" << tipl::vector<3>(new_args[i].translocation)
                       << " rotation=" << tipl::vector<3>(new_args[i].rotation) << std::endl;
 
-        },has_cuda ? gpu_count*4 : 1);
+        },thread_count);
 
         if(prog.aborted())
         {
@@ -1721,23 +1815,25 @@ bool ImageModel::load_topup_eddy_result(void)
         }
     }
     tipl::out() << "load topup/eddy results" << std::endl;
-    std::vector<std::shared_ptr<DwiHeader> > dwi_files;
-    if(!load_4d_nii(corrected_file.c_str(),dwi_files,false))
     {
-        error_msg = src_error_msg;
-        return false;
-    }
-    nifti_dwi.resize(dwi_files.size());
-    src_dwi_data.resize(dwi_files.size());
-    src_bvalues.resize(dwi_files.size());
-    src_bvectors.resize(dwi_files.size());
-    for(size_t index = 0;index < dwi_files.size();++index)
-    {
-        nifti_dwi[index].swap(dwi_files[index]->image);
-        src_dwi_data[index] = &nifti_dwi[index][0];
+        tipl::image<4,unsigned short> corrected_dwi;
+        tipl::vector<3> vs;
+        std::vector<float> bvalues;
+        std::vector<tipl::vector<3> > bvecs;
+        if(!load_4d_nii(corrected_file.c_str(),corrected_dwi,vs,bvalues,bvecs,false))
+        {
+            error_msg = src_error_msg;
+            return false;
+        }
+        nifti_dwi.swap(corrected_dwi);
+        voxel.vs = vs;
     }
-    voxel.vs = dwi_files[0]->voxel_size;
-    voxel.dim = nifti_dwi[0].shape();
+    voxel.dim = tipl::shape<3>(nifti_dwi.width(),nifti_dwi.height(),nifti_dwi.depth());
+    src_dwi_data.resize(nifti_dwi.shape()[3]);
+    src_bvalues.resize(src_dwi_data.size());
+    src_bvectors.resize(src_dwi_data.size());
+    for(size_t index = 0;index < src_dwi_data.size();++index)
+        src_dwi_data[index] = &nifti_dwi[index*voxel.dim.size()];
     if(has_topup)
         voxel.report += " The susceptibility artifact was estimated using reversed phase-encoding b0 by TOPUP from the Tiny FSL package (http://github.com/frankyeh/TinyFSL), a re-compiled version of FSL TOPUP (FMRIB, Oxford) with multi-thread support.";
     if(is_eddy)
@@ -2311,6 +2407,68 @@ void save_idx(const char* file_name,std::shared_ptr<tipl::io::gz_istream> in)
         in->save_index(idx_name.c_str());
     }
 }
+#ifdef DSI_STUDIO_USE_LIBTIFF
+// a whole-slide TIFF read through libtiff one tile (or strip) at a time. only tiled TIFFs, or
+// stripped ones with short strips, can be read this way, and strips span the full image width.
+struct tiff_slide{
+    TIFF* tif = nullptr;
+    uint32_t width = 0,height = 0,chunk_w = 0,chunk_h = 0,rows = 0;
+    bool tiled = false;
+    std::vector<uint32_t> raster;
+    tiff_slide(const std::string& file_name)
+    {
+        if(!(tif = TIFFOpen(file_name.c_str(),"r")))
+            return;
+        TIFFGetField(tif,TIFFTAG_IMAGEWIDTH,&width);
+        TIFFGetField(tif,TIFFTAG_IMAGELENGTH,&height);
+        if((tiled = TIFFIsTiled(tif)))
+        {
+            TIFFGetField(tif,TIFFTAG_TILEWIDTH,&chunk_w);
+            TIFFGetField(tif,TIFFTAG_TILELENGTH,&chunk_h);
+        }
+        else
+        {
+            chunk_w = width;
+            TIFFGetFieldDefaulted(tif,TIFFTAG_ROWSPERSTRIP,&chunk_h);
+            chunk_h = std::min(chunk_h,height);
+        }
+    }
+    ~tiff_slide(void)
+    {
+        if(tif)
+            TIFFClose(tif);
+    }
+    tiff_slide(const tiff_slide&) = delete;
+    tiff_slide& operator=(const tiff_slide&) = delete;
+    // a tile or strip must be small compared with the slide
+    bool can_read_by_chunk(size_t max_pixels) const
+    {
+        return tif && width && height && chunk_w && chunk_h && size_t(chunk_w)*size_t(chunk_h) <= max_pixels;
+    }
+    // call fun(x0,y0,w,h) for each tile or strip overlapping [x_from,x_to)x[y_from,y_to), with its pixels in gray()
+    template<typename Fun>
+    bool for_each_chunk(uint32_t x_from,uint32_t y_from,uint32_t x_to,uint32_t y_to,Fun&& fun)
+    {
+        raster.resize(size_t(chunk_w)*size_t(chunk_h));
+        for(uint32_t y0 = y_from/chunk_h*chunk_h;y0 < y_to;y0 += chunk_h)
+            for(uint32_t x0 = x_from/chunk_w*chunk_w;x0 < x_to;x0 += chunk_w)
+            {
+                if(!(tiled ? TIFFReadRGBATile(tif,x0,y0,raster.data()) : TIFFReadRGBAStrip(tif,y0,raster.data())))
+                    return false;
+                // the raster starts from the bottom row, a tile is always padded to its full length
+                rows = tiled ? chunk_h : std::min(chunk_h,height-y0);
+                fun(x0,y0,std::min(chunk_w,width-x0),std::min(chunk_h,height-y0));
+            }
+        return true;
+    }
+    // the first byte of a pixel, as read from QImage in the whole-image path
+    unsigned char gray(uint32_t dx,uint32_t dy) const
+    {
+        return uint8_t(TIFFGetB(raster[size_t(rows-1-dy)*chunk_w+dx]));
+    }
+};
+#endif
+
 size_t match_volume(float volume);
 bool ImageModel::load_from_file(const char* dwi_file_name)
 {
@@ -2332,16 +2490,8 @@ bool ImageModel::load_from_file(const char* dwi_file_name)
     if(std::filesystem::path(dwi_file_name).extension() == ".jpg" ||
        std::filesystem::path(dwi_file_name).extension() == ".tif")
     {
-        tipl::image<2,unsigned char> raw;
+        auto to_grayscale = [](const QImage& fig,tipl::image<2,unsigned char>& raw)
         {
-            QImage fig;
-            tipl::out() << "load picture";
-            if(!fig.load(dwi_file_name))
-            {
-                error_msg = "Unsupported image format";
-                return false;
-            }
-            tipl::out() << "converting to grayscale";
             int pixel_bytes = fig.bytesPerLine()/fig.width();
             raw.resize(tipl::shape<2>(uint32_t(fig.width()),uint32_t(fig.height())));
             tipl::par_for(raw.height(),[&](int y){
@@ -2350,17 +2500,97 @@ bool ImageModel::load_from_file(const char* dwi_file_name)
                 for(int x = 0;x < raw.width();++x,line += pixel_bytes)
                     out[x] = uint8_t(*line);
             });
+        };
+        tipl::image<2,unsigned char> raw;
+        QSize full_size = QImageReader(dwi_file_name).size();
+        bool tiled = false;
+#ifdef DSI_STUDIO_USE_LIBTIFF
+        if(std::filesystem::path(dwi_file_name).extension() == ".tif")
+        {
+            tiff_slide slide(dwi_file_name);
+            if(slide.tif)
+                full_size = QSize(int(slide.width),int(slide.height));
+            if(size_t(slide.width)*size_t(slide.height) > voxel.hist_max_pixels &&
+               slide.can_read_by_chunk(voxel.hist_max_pixels >> 6))
+            {
+                // keep the slide on disk: only the downsampled image for the mask is built, one tile or strip
+                // at a time, and each thread reads its own tile (with margin) during reconstruction
+                tipl::out() << "read " << slide.width << " by " << slide.height << " image " << (slide.tiled ? "tile" : "strip")
+                            << " by " << (slide.tiled ? "tile" : "strip");
+                uint32_t f = 1;
+                while((slide.width+f-1)/f > 2048)
+                    f <<= 1;
+                tipl::shape<2> small_shape((slide.width+f-1)/f,(slide.height+f-1)/f);
+                std::vector<uint32_t> sum(small_shape.size()),count(small_shape.size());
+                if(!slide.for_each_chunk(0,0,slide.width,slide.height,[&](uint32_t x0,uint32_t y0,uint32_t w,uint32_t h)
+                    {
+                        for(uint32_t dy = 0;dy < h;++dy)
+                            for(uint32_t dx = 0;dx < w;++dx)
+                            {
+                                size_t pos = size_t((y0+dy)/f)*small_shape.width()+(x0+dx)/f;
+                                sum[pos] += slide.gray(dx,dy);
+                                ++count[pos];
+                            }
+                    }))
+                {
+                    error_msg = "cannot read the TIFF slide";
+                    return false;
+                }
+                tipl::image<3,unsigned char> small(tipl::shape<3>(small_shape.width(),small_shape.height(),1));
+                for(size_t i = 0;i < small.size();++i)
+                    small[i] = uint8_t(count[i] ? sum[i]/count[i] : 0);
+                dwi = small;
+                std::string file_name(dwi_file_name);
+                voxel.hist_tile_shape = tipl::shape<2>(slide.width,slide.height);
+                voxel.hist_tile_reader = [file_name](const tipl::vector<2,int>& from,const tipl::vector<2,int>& to,
+                                                     tipl::image<2,unsigned char>& I)
+                {
+                    tiff_slide tile_slide(file_name);
+                    if(!tile_slide.tif)
+                        return false;
+                    I.resize(tipl::shape<2>(uint32_t(to[0]-from[0]),uint32_t(to[1]-from[1])));
+                    return tile_slide.for_each_chunk(uint32_t(from[0]),uint32_t(from[1]),uint32_t(to[0]),uint32_t(to[1]),
+                                                     [&](uint32_t x0,uint32_t y0,uint32_t w,uint32_t h)
+                    {
+                        for(uint32_t y = std::max<uint32_t>(y0,uint32_t(from[1]));y < std::min<uint32_t>(y0+h,uint32_t(to[1]));++y)
+                            for(uint32_t x = std::max<uint32_t>(x0,uint32_t(from[0]));x < std::min<uint32_t>(x0+w,uint32_t(to[0]));++x)
+                                I[size_t(y-uint32_t(from[1]))*I.width()+x-uint32_t(from[0])] = tile_slide.gray(x-x0,y-y0);
+                    });
+                };
+                tiled = true;
+            }
         }
-        tipl::out() << "generating mask";
-        auto raw_ = raw.alias(0,tipl::shape<3>(raw.width(),raw.height(),1));
-        if(raw.width() > 2048)
+#endif
+        // other formats (e.g. JPEG), single-strip TIFFs, or builds without libtiff are decoded whole
+        bool large_slide = full_size.isValid() && size_t(full_size.width())*size_t(full_size.height()) > voxel.hist_max_pixels;
+        if(large_slide && !tiled)
+            tipl::out() << "WARNING: " << full_size.width() << " by " << full_size.height()
+                        << " image cannot be read tile by tile (requires a tiled or stripped TIFF), loading the whole image";
+        if(!tiled)
         {
-            tipl::downsample_with_padding(raw_,dwi);
-            while(dwi.width() > 2048)
-                tipl::downsample_with_padding(dwi);
+            {
+                QImage fig;
+                tipl::out() << "load picture";
+                if(!fig.load(dwi_file_name))
+                {
+                    error_msg = large_slide ? "The image is too large to load whole, and only tiled or stripped TIFF can be read tile by tile" :
+                                              "Unsupported image format";
+                    return false;
+                }
+                tipl::out() << "converting to grayscale";
+                to_grayscale(fig,raw);
+            }
+            tipl::out() << "generating mask";
+            auto raw_ = raw.alias(0,tipl::shape<3>(raw.width(),raw.height(),1));
+            if(raw.width() > 2048)
+            {
+                tipl::downsample_with_padding(raw_,dwi);
+                while(dwi.width() > 2048)
+                    tipl::downsample_with_padding(dwi);
+            }
+            else
+                dwi = raw_;
         }
-        else
-            dwi = raw_;
 
         // increase contrast
         dwi -= 128;
@@ -2372,9 +2602,9 @@ bool ImageModel::load_from_file(const char* dwi_file_name)
         voxel.dim = dwi.shape();
         voxel.hist_image.swap(raw);
         voxel.report = "Histology image was loaded at a size of ";
-        voxel.report += std::to_string(voxel.hist_image.width());
+        voxel.report += std::to_string(voxel.hist_shape().width());
         voxel.report += " by ";
-        voxel.report += std::to_string(voxel.hist_image.height());
+        voxel.report += std::to_string(voxel.hist_shape().height());
         voxel.report += " pixels.";
 
         tipl::out() << "generating mask";
@@ -2396,28 +2626,15 @@ bool ImageModel::load_from_file(const char* dwi_file_name)
     }
     if(QString(dwi_file_name).toLower().endsWith(".nii.gz"))
     {
-        std::vector<std::shared_ptr<DwiHeader> > dwi_files;
-        if(!load_4d_nii(dwi_file_name,dwi_files,true))
+        if(!load_4d_nii(dwi_file_name,nifti_dwi,voxel.vs,src_bvalues,src_bvectors,true))
         {
             error_msg = src_error_msg;
             return false;
         }
-        nifti_dwi.resize(dwi_files.size());
-        src_dwi_data.resize(dwi_files.size());
-        src_bvalues.resize(dwi_files.size());
-        src_bvectors.resize(dwi_files.size());
-        for(size_t index = 0;index < dwi_files.size();++index)
-        {
-            if(index == 0)
-            {
-                voxel.vs = dwi_files[0]->voxel_size;
-                voxel.dim = dwi_files[0]->image.shape();
-            }
-            nifti_dwi[index].swap(dwi_files[index]->image);
-            src_dwi_data[index] = &nifti_dwi[index][0];
-            src_bvalues[index] = dwi_files[index]->bvalue;
-            src_bvectors[index] = dwi_files[index]->bvec;
-        }
+        voxel.dim = tipl::shape<3>(nifti_dwi.width(),nifti_dwi.height(),nifti_dwi.depth());
+        src_dwi_data.resize(src_bvalues.size());
+        for(size_t index = 0;index < src_dwi_data.size();++index)
+            src_dwi_data[index] = &nifti_dwi[index*voxel.dim.size()];
 
         get_report(voxel.report);
         calculate_dwi_sum(true);
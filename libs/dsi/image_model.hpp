@@ -222,7 +222,7 @@ struct ImageModel
     ImageModel operator=(const ImageModel&) = delete;
 public:
     std::vector<tipl::image<3,unsigned short> > new_dwi; //used in rotated volume
-    std::vector<tipl::image<3,unsigned short> > nifti_dwi; // if load directly from nifti
+    tipl::image<4,unsigned short> nifti_dwi; // if load directly from nifti, src_dwi_data points to each volume
 public:
     Voxel voxel;
     std::string file_name;
@@ -252,7 +252,7 @@ public:
     void flip_b_table(const unsigned char* order);
     void flip_b_table(unsigned char dim);
     void swap_b_table(unsigned char dim);
-    void flip_dwi(unsigned char type);
+    bool flip_dwi(unsigned char type);
     void rotate_one_dwi(unsigned int dwi_index,const tipl::transformation_matrix<double>& affine);
     void rotate(const tipl::shape<3>& new_geo,
                 const tipl::vector<3>& new_vs,
@@ -311,7 +311,7 @@ public:
 
         try
         {
-            if(voxel.run(prog_title))
+            if(voxel.run<ProcessList...>(prog_title))
                 return true;
             error_msg = "reconstruction canceled";
             return false;
@@ -2,12 +2,19 @@
 #define ODF_TRANSFORMATION_PROCESS_HPP
 #include "basic_process.hpp"
 #include "basic_voxel.hpp"
+#include <map>
+#include <random>
 
 class ReadDWIData : public BaseProcess{
 public:
     virtual void run(Voxel& voxel, VoxelData& data)
     {
         data.space.resize(voxel.dwi_data.size());
+        if(auto dwi = voxel.dwi_at(data.voxel_index))
+        {
+            std::copy(dwi,dwi+data.space.size(),data.space.begin());
+            return;
+        }
         for (unsigned int index = 0; index < data.space.size(); ++index)
             data.space[index] = voxel.dwi_data[index][data.voxel_index];
     }
@@ -96,12 +103,13 @@ public:
         new_q_count = total_signals;
         voxel.bvalues.swap(new_bvalues);
         voxel.bvectors.swap(new_bvectors);
+        voxel.scheme_trans = trans;
     }
     virtual void run(Voxel& voxel, VoxelData& data)
     {
-        std::vector<float> new_data(new_q_count);
-        data.space.swap(new_data);
-        tipl::mat::vector_product(trans.begin(),new_data.begin(),data.space.begin(),tipl::shape<2>(new_q_count,old_q_count));
+        data.space_buf.resize(new_q_count);
+        tipl::mat::vector_product(trans.begin(),data.space.begin(),data.space_buf.begin(),tipl::shape<2>(new_q_count,old_q_count));
+        data.space.swap(data.space_buf);
     }
 };
 
@@ -287,12 +295,14 @@ public:
 
 struct SearchLocalMaximum
 {
-    std::vector<std::vector<unsigned short> > neighbor;
+    // neighbors of direction i are neighbor[neighbor_pos[i]] ... neighbor[neighbor_pos[i+1]-1]
+    std::vector<uint32_t> neighbor_pos;
+    std::vector<unsigned short> neighbor;
     void init(Voxel& voxel)
     {
         unsigned int half_odf_size = voxel.ti.half_vertices_count;
         unsigned int faces_count = uint32_t(voxel.ti.faces.size());
-        neighbor.resize(voxel.ti.half_vertices_count);
+        std::vector<std::vector<unsigned short> > neighbor_list(voxel.ti.half_vertices_count);
         for (unsigned int index = 0;index < faces_count;++index)
         {
             unsigned short i1 = voxel.ti.faces[index][0];
@@ -304,58 +314,86 @@ struct SearchLocalMaximum
                 i2 -= half_odf_size;
             if (i3 >= half_odf_size)
                 i3 -= half_odf_size;
-            neighbor[i1].push_back(i2);
-            neighbor[i1].push_back(i3);
-            neighbor[i2].push_back(i1);
-            neighbor[i2].push_back(i3);
-            neighbor[i3].push_back(i1);
-            neighbor[i3].push_back(i2);
+            neighbor_list[i1].push_back(i2);
+            neighbor_list[i1].push_back(i3);
+            neighbor_list[i2].push_back(i1);
+            neighbor_list[i2].push_back(i3);
+            neighbor_list[i3].push_back(i1);
+            neighbor_list[i3].push_back(i2);
         }
+        neighbor_pos.resize(neighbor_list.size()+1);
+        neighbor.clear();
+        for (unsigned int index = 0;index < neighbor_list.size();++index)
+        {
+            auto& nei = neighbor_list[index];
+            std::sort(nei.begin(),nei.end());
+            nei.erase(std::unique(nei.begin(),nei.end()),nei.end());
+            neighbor_pos[index] = uint32_t(neighbor.size());
+            neighbor.insert(neighbor.end(),nei.begin(),nei.end());
+        }
+        neighbor_pos.back() = uint32_t(neighbor.size());
     }
-    void search(const std::vector<float>& old_odf,std::map<float,unsigned short,std::greater<float> >& max_table)
+    // the k largest local maxima in descending order, one entry for each value (the last direction) as in a map
+    void search(const std::vector<float>& old_odf,std::vector<std::pair<float,unsigned short> >& max_table,size_t k)
     {
         max_table.clear();
-        for (uint32_t index = 0;index < neighbor.size();++index)
+        if(!k)
+            return;
+        max_table.reserve(k+1);
+        for (uint32_t index = 0;index+1 < neighbor_pos.size();++index)
         {
             float value = old_odf[index];
+            // cannot enter the top k
+            if (max_table.size() == k && value < max_table.back().first)
+                continue;
             bool is_max = true;
-            std::vector<uint16_t>& nei = neighbor[index];
-            for (unsigned int j = 0;j < nei.size();++j)
-            {
-                if (value < old_odf[nei[j]])
+            for (uint32_t j = neighbor_pos[index],end = neighbor_pos[index+1];j < end;++j)
+                if (value < old_odf[neighbor[j]])
                 {
                     is_max = false;
                     break;
                 }
+            if (!is_max)
+                continue;
+            auto pos = max_table.begin();
+            while (pos != max_table.end() && pos->first > value)
+                ++pos;
+            if (pos != max_table.end() && pos->first == value)
+            {
+                pos->second = uint16_t(index);
+                continue;
             }
-            if (is_max)
-                max_table[value] = index;
+            max_table.insert(pos,std::make_pair(value,uint16_t(index)));
+            if (max_table.size() > k)
+                max_table.pop_back();
         }
     }
 };
 
 struct ODFShaping
 {
-
-    std::vector<std::vector<unsigned int> > shape_list;
+    // directions sorted by |cos| to each direction, half_odf_size-by-half_odf_size
+    std::vector<unsigned short> shape_list;
+    unsigned int half_odf_size = 0;
     void init(tessellated_icosahedron& ti)
     {
-        unsigned int half_odf_size = ti.half_vertices_count;
-        shape_list.clear();
-        for (unsigned int i = 0;i < half_odf_size;++i)
+        half_odf_size = ti.half_vertices_count;
+        shape_list.resize(size_t(half_odf_size)*size_t(half_odf_size));
+        tipl::par_for(half_odf_size,[&](unsigned int i)
         {
             std::vector<float> cos_value(half_odf_size);
             for(unsigned int j = 0;j < half_odf_size;++j)
                 cos_value[j] = std::fabs(ti.vertices_cos(i,j));
-            shape_list.push_back(tipl::arg_sort(cos_value,std::greater<float>()));
-        }
+            auto order = tipl::arg_sort(cos_value,std::greater<float>());
+            std::copy(order.begin(),order.end(),shape_list.begin()+int64_t(size_t(i)*half_odf_size));
+        });
     }
     void shape(std::vector<float>& odf,uint16_t dir)
     {
         float cur_max = odf[dir];
         odf[dir] = 0.0f;
-        const std::vector<unsigned int>& remove_list = shape_list[dir];
-        for (unsigned int index = 1;index < remove_list.size();++index)
+        const unsigned short* remove_list = &shape_list[size_t(dir)*half_odf_size];
+        for (unsigned int index = 1;index < half_odf_size;++index)
         {
             unsigned int pos = remove_list[index];
             cur_max = std::min<float>(odf[pos],cur_max);
@@ -364,8 +402,8 @@ struct ODFShaping
     }
     void reshape(std::vector<float>& odf,uint16_t dir)
     {
-        const std::vector<unsigned int>& remove_list = shape_list[dir];
-        for (unsigned int index = 1;index < remove_list.size();++index)
+        const unsigned short* remove_list = &shape_list[size_t(dir)*half_odf_size];
+        for (unsigned int index = 1;index < half_odf_size;++index)
         {
             float back_value = odf[remove_list[index]];
             if(back_value > odf[remove_list[index-1]])
@@ -462,7 +500,8 @@ public:
         data.min_odf = tipl::min_value(data.odf);
         if(voxel.odf_resolving)
         {
-            std::vector<float> odf(data.odf);
+            auto& odf = data.odf_buf;
+            odf = data.odf;
             tipl::minus_constant(odf,data.min_odf);
             float sum = std::accumulate(odf.begin(),odf.end(),0.0f);
             float last_fiber_sum = 0.0f;
@@ -507,10 +546,9 @@ public:
         }
         else
         {
-            std::map<float,unsigned short,std::greater<float> > max_table;
-            lm.search(data.odf,max_table);
-            auto iter = max_table.begin();
-            auto end = max_table.end();
+            lm.search(data.odf,data.peaks,voxel.max_fiber_number);
+            auto iter = data.peaks.begin();
+            auto end = data.peaks.end();
             for (unsigned int index = 0;iter != end && index < voxel.max_fiber_number;++index,++iter)
             {
                 data.dir_index[index] = iter->second;
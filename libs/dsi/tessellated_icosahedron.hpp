@@ -5,6 +5,8 @@
 #include <cmath>
 #include <vector>
 #include <functional>
+#include <memory>
+#include <mutex>
 #ifndef M_PI
 #define M_PI        3.14159265358979323846
 #endif
@@ -23,6 +25,77 @@ public:
     std::vector<tipl::vector<3,float> > vertices;
     std::vector<tipl::vector<3,unsigned short> > faces;
     std::vector<std::vector<float> > icosa_cos;
+private:
+    // cube-map lookup for discretize: candidates of cell i are dir_table[dir_table_pos[i]] ... dir_table[dir_table_pos[i+1]-1]
+    static constexpr int dir_table_size = 32;
+    std::vector<uint32_t> dir_table_pos;
+    std::vector<unsigned short> dir_table;
+    // the table is built by the first discretize, a copy or a reset starts over
+    struct once_type{
+        std::unique_ptr<std::once_flag> flag = std::make_unique<std::once_flag>();
+        once_type(void){}
+        once_type(const once_type&){}
+        once_type& operator=(const once_type&){flag = std::make_unique<std::once_flag>();return *this;}
+    } dir_table_once;
+    // cube face (major axis, folded to positive) and cell of a direction, or -1 for zero/non-finite vectors
+    static int dir_table_cell(const tipl::vector<3,float>& v)
+    {
+        int a = 0;
+        float m = std::fabs(v[0]);
+        if(std::fabs(v[1]) > m)
+            m = std::fabs(v[a = 1]);
+        if(std::fabs(v[2]) > m)
+            m = std::fabs(v[a = 2]);
+        if(!(m > 0.0f) || !std::isfinite(m))
+            return -1;
+        float sign = v[a] > 0.0f ? 0.5f*dir_table_size/m : -0.5f*dir_table_size/m;
+        int i = std::min<int>(dir_table_size-1,std::max<int>(0,int((v[(a+1)%3]*sign)+0.5f*dir_table_size)));
+        int j = std::min<int>(dir_table_size-1,std::max<int>(0,int((v[(a+2)%3]*sign)+0.5f*dir_table_size)));
+        return (a*dir_table_size+i)*dir_table_size+j;
+    }
+    void build_dir_table(void)
+    {
+        dir_table_pos.clear();
+        dir_table.clear();
+        auto cell_dir = [](int a,float s,float t)
+        {
+            tipl::vector<3,float> d;
+            d[a] = 1.0f;
+            d[(a+1)%3] = s;
+            d[(a+2)%3] = t;
+            d.normalize();
+            return d;
+        };
+        for(int a = 0;a < 3;++a)
+            for(int i = 0;i < dir_table_size;++i)
+                for(int j = 0;j < dir_table_size;++j)
+                {
+                    float s0 = 2.0f*float(i)/dir_table_size-1.0f,s1 = 2.0f*float(i+1)/dir_table_size-1.0f;
+                    float t0 = 2.0f*float(j)/dir_table_size-1.0f,t1 = 2.0f*float(j+1)/dir_table_size-1.0f;
+                    auto c = cell_dir(a,(s0+s1)*0.5f,(t0+t1)*0.5f);
+                    // chord radius of the cell, reached at its corners
+                    float r = 0.0f;
+                    for(float s : {s0,s1})
+                        for(float t : {t0,t1})
+                            r = std::max<float>(r,float((cell_dir(a,s,t)-c).length()));
+                    // |u*d| for d in the cell is within r of |u*c|, so the maximum can only be reached
+                    // by vertices within 2r of the best one at the center
+                    float best = 0.0f;
+                    for (unsigned int index = 0; index < half_vertices_count; ++index)
+                        best = std::max<float>(best,std::abs(vertices[index]*c));
+                    dir_table_pos.push_back(uint32_t(dir_table.size()));
+                    for (unsigned int index = 0; index < half_vertices_count; ++index)
+                        if(std::abs(vertices[index]*c) >= best-2.0f*r*1.05f-0.0001f)
+                            dir_table.push_back(uint16_t(index));
+                }
+        dir_table_pos.push_back(uint32_t(dir_table.size()));
+    }
+public:
+    // discard the discretize lookup table, needed whenever vertices are assigned directly
+    void reset_dir_table(void)
+    {
+        dir_table_once = once_type();
+    }
 private:
     double face_dis,angle_res;
     unsigned short cur_vertex = 0;
@@ -414,6 +487,7 @@ public:
             vertices[index] = odf_buffer;
         for (unsigned int  index = 0;index < faces_count_;++index,face_buffer += 3)
             faces[index] = face_buffer;
+        reset_dir_table();
     }
 
     tessellated_icosahedron(unsigned short fold_ = 8):fold(fold_)
@@ -462,7 +536,6 @@ public:
         check_vertex();
         check_face();
         #endif
-
     }
 
     float vertices_cos(unsigned int v1,unsigned int v2)
@@ -519,6 +592,22 @@ public:
     {
         unsigned short dir_index = 0;
         float max_value = 0.0;
+        std::call_once(*dir_table_once.flag,[this](void){build_dir_table();});
+        int cell = dir_table_pos.empty() ? -1 : dir_table_cell(v);
+        if(cell >= 0)
+        {
+            // same scan restricted to the candidates, in the same order
+            for (uint32_t k = dir_table_pos[uint32_t(cell)],end = dir_table_pos[uint32_t(cell)+1]; k < end; ++k)
+            {
+                float value = std::abs(vertices[dir_table[k]]*v);
+                if (value > max_value)
+                {
+                    max_value = value;
+                    dir_index = dir_table[k];
+                }
+            }
+            return dir_index;
+        }
         for (unsigned int index = 0; index < half_vertices_count; ++index)
         {
             float value = std::abs(vertices[index]*v);
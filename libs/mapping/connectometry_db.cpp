@@ -1,4 +1,5 @@
 #include <filesystem>
+#include <condition_variable>
 #include "connectometry_db.hpp"
 #include "fib_data.hpp"
 
@@ -28,9 +29,23 @@ bool connectometry_db::read_db(fib_data* handle_)
     handle = handle_;
     subject_qa.clear();
     unsigned int row,col;
+    // with fixel-major chunks, statistics read the chunks and the subject-major data are
+    // only loaded by load_subject_qa when needed. The first subject is read to check the sign.
+    // With metadata_only, no subject data are read at all.
+    std::vector<float> layout;
+    bool defer_subject_qa = metadata_only ||
+                            (handle->mat_reader.read("fixel_layout",layout) && layout.size() == 3 &&
+                            !std::filesystem::exists(shard_file_name(handle->fib_file_name,1)));
     for(unsigned int index = 0;1;++index)
     {
         const float* buf = nullptr;
+        if(defer_subject_qa && (index || metadata_only))
+        {
+            if (!handle->mat_reader.get_col_row((std::string("subjects")+std::to_string(index)).c_str(),row,col) &&
+                !handle->mat_reader.get_col_row((std::string("subject")+std::to_string(index)).c_str(),row,col))
+                break;
+        }
+        else
         if (!handle->mat_reader.read((std::string("subjects")+std::to_string(index)).c_str(),row,col,buf) &&
             !handle->mat_reader.read((std::string("subject")+std::to_string(index)).c_str(),row,col,buf))
             break;
@@ -39,7 +54,7 @@ bool connectometry_db::read_db(fib_data* handle_)
             subject_qa_length = row*col;
             // check if the db is longitudinal, for older db, the only way to check is by the negative values.
             is_longitudinal = false;
-            for(size_t i = 0;i < subject_qa_length;++i)
+            for(size_t i = 0;buf && i < subject_qa_length;++i)
                 if(buf[i] < 0.0f)
                 {
                     is_longitudinal = true;
@@ -65,6 +80,59 @@ bool connectometry_db::read_db(fib_data* handle_)
         subject_qa.clear();
         return false;
     }
+    handle->mat_reader.read("demo",demo);
+    // subjects appended later are stored in shards next to the db file, see append_db
+    stored_subject_qa.clear();
+    stored_subject_count = 0;
+    for(shard_count = 0;;++shard_count)
+    {
+        std::string shard_name = shard_file_name(handle->fib_file_name,shard_count+1);
+        if(!std::filesystem::exists(shard_name))
+            break;
+        tipl::io::gz_mat_read shard;
+        std::vector<float> range;
+        if(!shard.load_from_file(shard_name.c_str()) || !shard.read("shard_range",range) ||
+           range.size() != 2 || size_t(range[0]) != num_subjects)
+        {
+            error_msg = "invalid or out-of-order db shard ";
+            error_msg += shard_name;
+            num_subjects = 0;
+            subject_qa.clear();
+            return false;
+        }
+        for(unsigned int index = num_subjects;index < num_subjects+uint32_t(range[1]);++index)
+        {
+            const float* buf = nullptr;
+            std::string name = std::string("subjects")+std::to_string(index);
+            if(!(metadata_only ? shard.get_col_row(name.c_str(),row,col) : shard.read(name.c_str(),row,col,buf)) ||
+               size_t(row)*col != subject_qa_length)
+            {
+                error_msg = "invalid subject data in ";
+                error_msg += shard_name;
+                num_subjects = 0;
+                subject_qa.clear();
+                return false;
+            }
+            if(metadata_only)
+            {
+                subject_qa.push_back(nullptr);
+                continue;
+            }
+            subject_qa_buf.push_back(std::vector<float>(buf,buf+subject_qa_length));
+            subject_qa.push_back(subject_qa_buf.back().data());
+        }
+        num_subjects = uint32_t(subject_qa.size());
+        // the latest shard holds the metadata of all subjects
+        shard.read("subject_names",subject_names_str);
+        shard.read("R2",R2);
+        shard.read("demo",demo);
+        tipl::out() << "db shard " << shard_name << " adds " << range[1] << " subject(s)" << std::endl;
+    }
+    subject_names.resize(num_subjects);
+    R2.resize(num_subjects);
+    stored_subject_qa = subject_qa;
+    stored_subject_count = num_subjects;
+
     // optional
     handle->mat_reader.read("report",report);
     handle->mat_reader.read("subject_report",subject_report);
@@ -83,13 +151,44 @@ bool connectometry_db::read_db(fib_data* handle_)
             longitudinal_filter_type = 2;
     }
 
+    // optional fixel-major chunks, only usable if written with the same subjects
+    fixel_chunk_count = 0;
+    if(layout.size() == 3 && layout[0] >= 1.0f &&
+       size_t(layout[1]) == num_subjects && size_t(layout[2]) == subject_qa_length)
+    {
+        fixel_chunk_size = size_t(layout[0]);
+        fixel_chunk_count = uint32_t((subject_qa_length+fixel_chunk_size-1)/fixel_chunk_size);
+        tipl::out() << "fixel-major chunks: " << fixel_chunk_count << std::endl;
+        if(handle->mat_reader.get_col_row("fixel_range0",row,col))
+            tipl::out() << "fixel-major chunks are quantized to uint16 within each fixel's value range" << std::endl;
+    }
+    if(!fixel_chunk_count && !metadata_only && !load_subject_qa())
+    {
+        num_subjects = 0;
+        subject_qa.clear();
+        return false;
+    }
+
     // make sure qa is normalized
-    if(!is_longitudinal && (index_name == "qa" || index_name.empty()))
+    if(!metadata_only && !is_longitudinal && (index_name == "qa" || index_name.empty()))
     {
+        if(!load_subject_qa(0))
+        {
+            num_subjects = 0;
+            subject_qa.clear();
+            return false;
+        }
         auto max_qa = tipl::max_value(subject_qa[0],subject_qa[0]+subject_qa_length);
         if(max_qa != 1.0f)
         {
             tipl::out() << "converting raw QA to normalized QA" << std::endl;
+            fixel_chunk_count = 0;
+            if(!load_subject_qa())
+            {
+                num_subjects = 0;
+                subject_qa.clear();
+                return false;
+            }
             tipl::par_for(subject_qa.size(),[&](size_t i)
             {
                 auto max_qa = tipl::max_value(subject_qa[i],subject_qa[i]+subject_qa_length);
@@ -115,7 +214,7 @@ bool connectometry_db::read_db(fib_data* handle_)
     }
 
 
-    if(handle->mat_reader.read("demo",demo))
+    if(!demo.empty())
     {
         if(!parse_demo())
             return false;
@@ -333,18 +432,23 @@ void connectometry_db::clear(void)
     R2.clear();
     subject_qa.clear();
     subject_qa_buf.clear();
+    stored_subject_qa.clear();
+    stored_subject_count = 0;
     num_subjects = 0;
+    fixel_chunk_count = 0;
     modified = true;
 }
 
 void connectometry_db::remove_subject(unsigned int index)
 {
-    if(index >= subject_qa.size())
+    // deferred subjects are read by their index and must be loaded before the list changes
+    if(index >= subject_qa.size() || !load_subject_qa())
         return;
     subject_qa.erase(subject_qa.begin()+index);
     subject_names.erase(subject_names.begin()+index);
     R2.erase(R2.begin()+index);
     --num_subjects;
+    fixel_chunk_count = 0;
     modified = true;
 }
 void connectometry_db::calculate_si2vi(void)
@@ -375,19 +479,20 @@ size_t convert_index(size_t old_index,
     return new_pos.index();
 }
 
-bool connectometry_db::is_odf_consistent(tipl::io::gz_mat_read& m)
+bool connectometry_db::is_odf_consistent(tipl::io::gz_mat_read& m,std::string& reason) const
 {
+    // the reason goes to the caller's message, subjects are checked concurrently
     unsigned int row,col;
     const float* odf_buffer = nullptr;
     m.read("odf_vertices",row,col,odf_buffer);
     if (!odf_buffer)
     {
-        error_msg = "No odf_vertices matrix in ";
+        reason = "No odf_vertices matrix in ";
         return false;
     }
     if(col != handle->dir.odf_table.size())
     {
-        error_msg = "Inconsistent ODF dimension in ";
+        reason = "Inconsistent ODF dimension in ";
         return false;
     }
     for (unsigned int index = 0;index < col;++index,odf_buffer += 3)
@@ -396,7 +501,7 @@ bool connectometry_db::is_odf_consistent(tipl::io::gz_mat_read& m)
            handle->dir.odf_table[index][1] != odf_buffer[1] ||
            handle->dir.odf_table[index][2] != odf_buffer[2])
         {
-            error_msg = "Inconsistent ODF in ";
+            reason = "Inconsistent ODF in ";
             return false;
         }
     }
@@ -418,7 +523,7 @@ bool connectometry_db::is_odf_consistent(tipl::io::gz_mat_read& m)
     return true;
 }
 void connectometry_db::sample_from_image(tipl::const_pointer_image<3,float> I,
-                       const tipl::matrix<4,4>& trans,std::vector<float>& data)
+                       const tipl::matrix<4,4>& trans,std::vector<float>& data) const
 {
     tipl::image<3> J(handle->dim);
     tipl::resample_mt<tipl::interpolation::cubic>(I,J,
@@ -431,12 +536,11 @@ void connectometry_db::sample_from_image(tipl::const_pointer_image<3,float> I,
         data[si] = J[si2vi[si]];
     });
 }
-bool connectometry_db::add(const std::string& file_name,
-                                         const std::string& subject_name)
+bool connectometry_db::load_subject(subject_data& subject) const
 {
-    tipl::progress prog(file_name.c_str());
-    std::vector<float> data;
-    float subject_R2 = 1.0f;
+    const auto& file_name = subject.file_name;
+    auto& data = subject.data;
+    auto& error_msg = subject.error_msg;
     if(tipl::ends_with(file_name,".nii") || tipl::ends_with(file_name,".nii.gz"))
     {
         tipl::vector<3> vs;
@@ -452,7 +556,8 @@ bool connectometry_db::add(const std::string& file_name,
     }
     else
     {
-        fib_data fib;
+        auto fib_ptr = std::make_shared<fib_data>();
+        auto& fib = *fib_ptr;
         if(!fib.load_from_file(file_name.c_str()))
         {
             error_msg = "Cannot read file ";
@@ -463,19 +568,20 @@ bool connectometry_db::add(const std::string& file_name,
         }
 
         if(fib.db.has_db())
-            return add_db(fib.db);
+        {
+            subject.db_fib = fib_ptr;
+            return true;
+        }
 
-        if(subject_report.empty())
-            subject_report = fib.report;
-        fib.mat_reader.read("R2",subject_R2);
+        subject.report = fib.report;
+        fib.mat_reader.read("R2",subject.R2);
 
         if(fib.is_mni && fib.has_odfs() &&
            (index_name == "qa" || index_name == "nqa" || index_name.empty()))
         {
             odf_data subject_odf;
-            if(!is_odf_consistent(fib.mat_reader))
+            if(!is_odf_consistent(fib.mat_reader,error_msg))
             {
-                error_msg = "Inconsistent ODF at ";
                 error_msg += file_name;
                 return false;
             }
@@ -534,13 +640,14 @@ bool connectometry_db::add(const std::string& file_name,
                     sample_from_image(fib.view_item[index].get_image(),fib.trans_to_mni,data);
                 else
                 {
+                    // normalize in the calling thread, subjects may already be loaded concurrently
                     fib.set_template_id(handle->template_id);
-                    fib.map_to_mni();
-                    while(!prog.aborted() && fib.prog != 6)
-                        std::this_thread::yield();
-                    if(prog.aborted())
+                    if(!fib.map_to_mni(false) || fib.t2s.empty())
                     {
-                        error_msg = "aborted";
+                        error_msg = "cannot normalize ";
+                        error_msg += file_name;
+                        error_msg += " : ";
+                        error_msg += fib.error_msg;
                         return false;
                     }
                     tipl::image<3> Iss(fib.t2s.shape());
@@ -567,24 +674,151 @@ bool connectometry_db::add(const std::string& file_name,
         error_msg += file_name;
         return false;
     }
-
-    R2.push_back(subject_R2);
-    subject_qa_length = std::min<size_t>(subject_qa_length,data.size());
-    subject_qa_buf.push_back(std::move(data));
+    return true;
+}
+bool connectometry_db::add_subject(subject_data& subject)
+{
+    if(subject.db_fib)
+    {
+        if(!subject.db_fib->db.load_subject_qa())
+        {
+            error_msg = subject.db_fib->db.error_msg;
+            return false;
+        }
+        return add_db(subject.db_fib->db);
+    }
+    if(subject_report.empty())
+        subject_report = subject.report;
+    R2.push_back(subject.R2);
+    subject_qa_length = std::min<size_t>(subject_qa_length,subject.data.size());
+    subject_qa_buf.push_back(std::move(subject.data));
     subject_qa.push_back(&(subject_qa_buf.back()[0]));
-    subject_names.push_back(subject_name);
+    subject_names.push_back(subject.subject_name);
     num_subjects++;
+    fixel_chunk_count = 0;
     modified = true;
+    return true;
+}
+bool connectometry_db::add(const std::string& file_name,
+                                         const std::string& subject_name)
+{
+    tipl::progress prog(file_name.c_str());
+    subject_data subject;
+    subject.file_name = file_name;
+    subject.subject_name = subject_name;
+    if(!load_subject(subject))
+    {
+        error_msg = subject.error_msg;
+        return false;
+    }
     if(prog.aborted())
     {
         error_msg = "aborted";
         return false;
     }
-    return true;
+    return add_subject(subject);
+}
+bool connectometry_db::add(const std::vector<std::string>& file_names,
+                           const std::vector<std::string>& subject_names_,
+                           unsigned int thread_count)
+{
+    thread_count = std::max<unsigned int>(1,std::min<unsigned int>(thread_count,uint32_t(file_names.size())));
+    if(thread_count <= 1)
+    {
+        for(size_t i = 0;i < file_names.size();++i)
+            if(!add(file_names[i],subject_names_[i]))
+                return false;
+        return true;
+    }
+    tipl::progress prog("reading subject data");
+    // subjects are loaded by a bounded pool of threads, at most thread_count ahead of the insertion point,
+    // and inserted in the given order.
+    std::vector<subject_data> subjects(file_names.size());
+    std::vector<unsigned char> status(file_names.size()); // 0:loading 1:loaded 2:failed
+    size_t next = 0,inserted = 0;
+    bool stop = false;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<std::thread> threads;
+    for(unsigned int t = 0;t < thread_count;++t)
+        threads.push_back(std::thread([&]()
+        {
+            while(true)
+            {
+                size_t i = 0;
+                {
+                    std::unique_lock<std::mutex> lk(lock);
+                    cv.wait(lk,[&](){return stop || next >= subjects.size() || next < inserted+thread_count;});
+                    if(stop || next >= subjects.size())
+                        return;
+                    i = next++;
+                }
+                subjects[i].file_name = file_names[i];
+                subjects[i].subject_name = subject_names_[i];
+                bool result = load_subject(subjects[i]);
+                {
+                    std::lock_guard<std::mutex> lk(lock);
+                    status[i] = result ? 1 : 2;
+                }
+                cv.notify_all();
+            }
+        }));
+
+    bool result = true;
+    for(size_t i = 0;i < subjects.size() && result;++i)
+    {
+        if(!prog(i,subjects.size()))
+        {
+            error_msg = "aborted";
+            result = false;
+            break;
+        }
+        {
+            std::unique_lock<std::mutex> lk(lock);
+            while(!cv.wait_for(lk,std::chrono::milliseconds(100),[&](){return status[i] != 0;}))
+            {
+                lk.unlock();
+                bool aborted = !prog(i,subjects.size());
+                lk.lock();
+                if(aborted)
+                    break;
+            }
+            if(status[i] == 0)
+            {
+                error_msg = "aborted";
+                result = false;
+                break;
+            }
+        }
+        tipl::out() << "adding " << subjects[i].subject_name << std::endl;
+        if(status[i] == 2)
+        {
+            error_msg = subjects[i].error_msg;
+            result = false;
+            break;
+        }
+        result = add_subject(subjects[i]);
+        subjects[i] = subject_data();
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            ++inserted;
+        }
+        cv.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        stop = true;
+    }
+    cv.notify_all();
+    for(auto& t : threads)
+        t.join();
+    return result;
 }
 
 bool connectometry_db::save_db(const char* output_name)
 {
+    if(!load_subject_qa())
+        return false;
     // store results
     tipl::io::gz_mat_write matfile(output_name);
     if(!matfile)
@@ -596,7 +830,8 @@ bool connectometry_db::save_db(const char* output_name)
     for(unsigned int index = 0;index < handle->mat_reader.size();++index)
         if(handle->mat_reader[index].get_name() != "report" &&
            handle->mat_reader[index].get_name() != "steps" &&
-           handle->mat_reader[index].get_name().find("subject") != 0)
+           handle->mat_reader[index].get_name().find("subject") != 0 &&
+           handle->mat_reader[index].get_name().find("fixel") != 0)
             matfile.write(handle->mat_reader[index]);
     tipl::progress prog("save db");
     for(unsigned int index = 0;prog(index,subject_qa.size());++index)
@@ -606,6 +841,57 @@ bool connectometry_db::save_db(const char* output_name)
         error_msg = "aborted";
         return false;
     }
+    if(fixel_major && num_subjects)
+    {
+        // transposed copy so that statistics read each fixel's population contiguously
+        tipl::progress prog2("save fixel-major chunks");
+        if(fixel_quantize)
+            tipl::out() << "quantizing fixel-major chunks to uint16 within each fixel's value range" << std::endl;
+        unsigned int chunk_count = uint32_t((subject_qa_length+fixel_chunk_size-1)/fixel_chunk_size);
+        std::vector<float> values,range;
+        std::vector<unsigned short> q;
+        for(unsigned int c = 0;prog2(c,chunk_count);++c)
+        {
+            size_t from = size_t(c)*fixel_chunk_size;
+            size_t count = std::min<size_t>(fixel_chunk_size,subject_qa_length-from);
+            values.resize(count*num_subjects);
+            tipl::par_for(count,[&](size_t j)
+            {
+                float* v = values.data()+j*num_subjects;
+                for(size_t s = 0;s < num_subjects;++s)
+                    v[s] = subject_qa[s][from+j];
+            });
+            auto name = std::string("fixels")+std::to_string(c);
+            if(fixel_quantize)
+            {
+                // each fixel quantized linearly to its own value range
+                q.resize(values.size());
+                range.resize(count*2);
+                tipl::par_for(count,[&](size_t j)
+                {
+                    const float* v = values.data()+j*num_subjects;
+                    auto min_max = std::minmax_element(v,v+num_subjects);
+                    float scale = (*min_max.second-*min_max.first)/65535.0f;
+                    range[j*2] = *min_max.first;
+                    range[j*2+1] = scale;
+                    unsigned short* qv = q.data()+j*num_subjects;
+                    for(size_t s = 0;s < num_subjects;++s)
+                        qv[s] = scale == 0.0f ? 0 : uint16_t(std::round((v[s]-*min_max.first)/scale));
+                });
+                matfile.write(name.c_str(),q.data(),num_subjects,uint32_t(count));
+                matfile.write((std::string("fixel_range")+std::to_string(c)).c_str(),range.data(),2,uint32_t(count));
+            }
+            else
+                matfile.write(name.c_str(),values.data(),num_subjects,uint32_t(count));
+        }
+        if(prog2.aborted())
+        {
+            error_msg = "aborted";
+            return false;
+        }
+        std::vector<float> layout = {float(fixel_chunk_size),float(num_subjects),float(subject_qa_length)};
+        matfile.write("fixel_layout",layout);
+    }
     std::string name_string;
     for(unsigned int index = 0;index < num_subjects;++index)
     {
@@ -631,29 +917,192 @@ bool connectometry_db::save_db(const char* output_name)
     }
     if(!demo.empty())
         matfile.write("demo",demo);
+    // shards of an overwritten db are now part of the file
+    for(unsigned int k = 1;std::filesystem::exists(shard_file_name(output_name,k));++k)
+        std::filesystem::remove(shard_file_name(output_name,k));
+    modified = false;
+    return true;
+}
+
+bool connectometry_db::append_db(void)
+{
+    if(!handle || handle->fib_file_name.empty() || !stored_subject_count)
+    {
+        error_msg = "appending requires a db loaded from a file";
+        return false;
+    }
+    if(subject_qa.size() < stored_subject_count ||
+       !std::equal(stored_subject_qa.begin(),stored_subject_qa.end(),subject_qa.begin()))
+    {
+        error_msg = "stored subjects were removed, reordered, or recalculated. Save the whole db instead";
+        return false;
+    }
+    if(num_subjects == stored_subject_count)
+    {
+        error_msg = "no new subject to append";
+        return false;
+    }
+    // the shard replaces the demographics, so they must cover the appended subjects as well
+    if(!demo.empty())
+    {
+        size_t row_count = 0;
+        std::istringstream in(demo);
+        std::string line;
+        for(bool title = true;std::getline(in,line) && !line.empty() && line != "\r";title = false)
+            if(!title)
+                ++row_count;
+        if(row_count != num_subjects)
+        {
+            std::ostringstream out;
+            out << "the demographics have " << row_count << " subject rows, but the db will have " << num_subjects
+                << " subjects. Provide demographics with one row for each subject";
+            error_msg = out.str();
+            return false;
+        }
+    }
+    // existing subject data are left untouched, new subjects and all metadata go to a new shard
+    std::string shard_name = shard_file_name(handle->fib_file_name,shard_count+1);
+    std::string tmp_name = handle->fib_file_name+".append.tmp.gz";
+    {
+        tipl::io::gz_mat_write matfile(tmp_name.c_str());
+        if(!matfile)
+        {
+            error_msg = "Cannot save file ";
+            error_msg += tmp_name;
+            return false;
+        }
+        tipl::progress prog("append db");
+        for(unsigned int index = stored_subject_count;prog(index-stored_subject_count,num_subjects-stored_subject_count);++index)
+            matfile.write((std::string("subjects")+std::to_string(index)).c_str(),subject_qa[index],1,subject_qa_length);
+        if(prog.aborted())
+        {
+            error_msg = "aborted";
+            return false;
+        }
+        std::vector<float> range = {float(stored_subject_count),float(num_subjects-stored_subject_count)};
+        matfile.write("shard_range",range);
+        std::string name_string;
+        for(unsigned int index = 0;index < num_subjects;++index)
+        {
+            name_string += subject_names[index];
+            name_string += "\n";
+        }
+        matfile.write("subject_names",name_string);
+        matfile.write("R2",R2);
+        if(!demo.empty())
+            matfile.write("demo",demo);
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_name,shard_name,ec);
+    if(ec)
+    {
+        error_msg = "Cannot save file ";
+        error_msg += shard_name;
+        return false;
+    }
+    tipl::out() << num_subjects-stored_subject_count << " subject(s) appended to " << shard_name << std::endl;
+    tipl::out() << "the db is incomplete without its .append<k>.gz files. Copy or move them together with " << handle->fib_file_name << std::endl;
+    stored_subject_qa = subject_qa;
+    stored_subject_count = num_subjects;
+    ++shard_count;
     modified = false;
     return true;
 }
 
+bool connectometry_db::load_subject_qa(unsigned int index)
+{
+    if(index >= subject_qa.size())
+    {
+        error_msg = "invalid subject index";
+        return false;
+    }
+    if(subject_qa[index])
+        return true;
+    unsigned int row,col;
+    const float* buf = nullptr;
+    if (!handle->mat_reader.read((std::string("subjects")+std::to_string(index)).c_str(),row,col,buf) &&
+        !handle->mat_reader.read((std::string("subject")+std::to_string(index)).c_str(),row,col,buf))
+    {
+        error_msg = "cannot read the data of subject ";
+        error_msg += std::to_string(index);
+        return false;
+    }
+    subject_qa[index] = buf;
+    if(index < stored_subject_qa.size() && !stored_subject_qa[index])
+        stored_subject_qa[index] = buf;
+    return true;
+}
+bool connectometry_db::load_subject_qa(void)
+{
+    for(unsigned int index = 0;index < subject_qa.size();++index)
+        if(!load_subject_qa(index))
+            return false;
+    return true;
+}
+
+bool connectometry_db::get_fixel_chunk(unsigned int chunk,std::vector<float>& values) const
+{
+    if(chunk >= fixel_chunk_count)
+    {
+        error_msg = "invalid fixel chunk";
+        return false;
+    }
+    auto name = std::string("fixels")+std::to_string(chunk);
+    size_t count = std::min<size_t>(fixel_chunk_size,subject_qa_length-size_t(chunk)*fixel_chunk_size);
+    unsigned int row = 0,col = 0;
+    const float* range = nullptr;
+    if(handle->mat_reader.read((std::string("fixel_range")+std::to_string(chunk)).c_str(),row,col,range))
+    {
+        const unsigned short* q = nullptr;
+        if(!handle->mat_reader.read(name.c_str(),row,col,q) || row != num_subjects || col != count)
+        {
+            error_msg = "invalid fixel-major chunk ";
+            error_msg += name;
+            return false;
+        }
+        values.resize(size_t(row)*col);
+        for(size_t j = 0,pos = 0;j < col;++j)
+            for(size_t s = 0;s < row;++s,++pos)
+                values[pos] = range[j*2]+range[j*2+1]*float(q[pos]);
+        return true;
+    }
+    const float* buf = nullptr;
+    if(!handle->mat_reader.read(name.c_str(),row,col,buf) || row != num_subjects || col != count)
+    {
+        error_msg = "invalid fixel-major chunk ";
+        error_msg += name;
+        return false;
+    }
+    values.assign(buf,buf+size_t(row)*col);
+    return true;
+}
+
 void connectometry_db::get_subject_slice(unsigned int subject_index,unsigned char dim,unsigned int pos,
-                        tipl::image<2,float>& slice) const
+                        tipl::image<2,float>& slice)
 {
     tipl::image<2,size_t> tmp;
     tipl::volume2slice(vi2si, tmp, dim, pos);
     slice.clear();
     slice.resize(tmp.shape());
+    if(!load_subject_qa(subject_index))
+    {
+        tipl::out() << "ERROR: " << error_msg << std::endl;
+        return;
+    }
     for(unsigned int index = 0;index < slice.size();++index)
         if(tmp[index])
             slice[index] = subject_qa[subject_index][tmp[index]];
 }
 
-bool connectometry_db::get_demo_matched_volume(const std::string& matched_demo,tipl::image<3>& volume) const
+bool connectometry_db::get_demo_matched_volume(const std::string& matched_demo,tipl::image<3>& volume)
 {
     if(demo.empty())
     {
         error_msg = "no demographic data found in the database";
         return false;
     }
+    if(!load_subject_qa())
+        return false;
     if(matched_demo.empty())
     {
         error_msg = "no demographics provided for the study subject";
@@ -710,7 +1159,7 @@ bool connectometry_db::get_demo_matched_volume(const std::string& matched_demo,t
     volume.swap(I);
     return true;
 }
-bool connectometry_db::save_demo_matched_image(const std::string& matched_demo,const std::string& filename) const
+bool connectometry_db::save_demo_matched_image(const std::string& matched_demo,const std::string& filename)
 {
     tipl::image<3> I;
     if(!get_demo_matched_volume(matched_demo,I))
@@ -723,19 +1172,30 @@ bool connectometry_db::save_demo_matched_image(const std::string& matched_demo,c
     }
     return true;
 }
-void connectometry_db::get_subject_volume(unsigned int subject_index,tipl::image<3>& volume) const
+void connectometry_db::get_subject_volume(unsigned int subject_index,tipl::image<3>& volume)
 {
     tipl::image<3> I(handle->dim);
+    if(!load_subject_qa(subject_index))
+    {
+        tipl::out() << "ERROR: " << error_msg << std::endl;
+        volume.swap(I);
+        return;
+    }
     for(unsigned int index = 0;index < I.size();++index)
         if(vi2si[index])
             I[index] = subject_qa[subject_index][vi2si[index]];
     volume.swap(I);
 }
-void connectometry_db::get_subject_fa(unsigned int subject_index,std::vector<std::vector<float> >& fa_data) const
+void connectometry_db::get_subject_fa(unsigned int subject_index,std::vector<std::vector<float> >& fa_data)
 {
     fa_data.resize(handle->dir.num_fiber);
     for(char index = 0;index < handle->dir.num_fiber;++index)
         fa_data[index].resize(handle->dim.size());
+    if(!load_subject_qa(subject_index))
+    {
+        tipl::out() << "ERROR: " << error_msg << std::endl;
+        return;
+    }
     tipl::par_for(si2vi.size(),[&](unsigned int s_index)
     {
         size_t cur_index = si2vi[s_index];
@@ -755,8 +1215,11 @@ bool connectometry_db::get_qa_profile(const char* file_name,std::vector<std::vec
         error_msg = "fail to load the fib file";
         return false;
     }
-    if(!is_odf_consistent(single_subject))
+    if(!is_odf_consistent(single_subject,error_msg))
+    {
+        error_msg += file_name;
         return false;
+    }
     odf_data subject_odf;
     if(!subject_odf.read(single_subject))
     {
@@ -816,29 +1279,37 @@ bool connectometry_db::add_db(const connectometry_db& rhs)
         subject_qa.push_back(&(subject_qa_buf.back()[0]));
     }
     num_subjects += rhs.num_subjects;
+    fixel_chunk_count = 0;
     modified = true;
     return true;
 }
 void connectometry_db::move_up(int id)
 {
-    if(id == 0)
+    if(id == 0 || !load_subject_qa())
         return;
     std::swap(subject_names[uint32_t(id)],subject_names[uint32_t(id-1)]);
     std::swap(R2[uint32_t(id)],R2[uint32_t(id-1)]);
     std::swap(subject_qa[uint32_t(id)],subject_qa[uint32_t(id-1)]);
+    fixel_chunk_count = 0;
 }
 
 void connectometry_db::move_down(int id)
 {
-    if(uint32_t(id) >= num_subjects-1)
+    if(uint32_t(id) >= num_subjects-1 || !load_subject_qa())
         return;
     std::swap(subject_names[uint32_t(id)],subject_names[uint32_t(id+1)]);
     std::swap(R2[uint32_t(id)],R2[uint32_t(id+1)]);
     std::swap(subject_qa[uint32_t(id)],subject_qa[uint32_t(id+1)]);
+    fixel_chunk_count = 0;
 }
 
 void connectometry_db::calculate_change(unsigned char dif_type,unsigned char filter_type)
 {
+    if(!load_subject_qa())
+    {
+        tipl::out() << "ERROR: " << error_msg << std::endl;
+        return;
+    }
     std::ostringstream out;
 
 
@@ -911,6 +1382,7 @@ void connectometry_db::calculate_change(unsigned char dif_type,unsigned char fil
     subject_qa_buf.swap(new_subject_qa_buf);
     subject_qa.swap(new_subject_qa);
     num_subjects = uint32_t(match.size());
+    fixel_chunk_count = 0;
     match.clear();
     report += out.str();
     modified = true;
@@ -939,6 +1411,12 @@ void connectometry_result::clear_result(char num_fiber,size_t image_size)
         dec_ptr[fib] = &dec[fib][0];
     }
 }
+void connectometry_result::clear_fixel_result(char num_fiber,size_t fixel_count_)
+{
+    fixel_count = fixel_count_;
+    fixel_t.resize(size_t(num_fiber)*fixel_count);
+    std::fill(fixel_t.begin(),fixel_t.end(),0.0f);
+}
 
 void stat_model::read_demo(const connectometry_db& db)
 {
@@ -1285,6 +1763,14 @@ bool stat_model::resample(stat_model& rhs,bool null,bool bootstrap,unsigned int
                     permutation_order[i] = rand_gen(2);
             }
         }
+
+        // compose resampling and permutation so that statistics can be computed in one pass
+        sample_map.resize(selected_subject.size());
+        for(unsigned int index = 0;index < sample_map.size();++index)
+        {
+            unsigned int j = (study_feature && !permutation_order.empty()) ? permutation_order[index] : index;
+            sample_map[index] = resample_order.empty() ? j : resample_order[j];
+        }
     }
 
     return true;
@@ -1305,6 +1791,38 @@ void stat_model::partial_correlation(std::vector<float>& population) const
             }
     }
 }
+unsigned int stat_model::partial_correlation_projection(std::vector<float>& P,std::vector<float>& Xc) const
+{
+    // partial_correlation is linear in population: population -= Xc*(P*population)
+    // P holds the regression coefficients of the covariates as rows, obtained by regressing unit vectors
+    P.clear();
+    Xc.clear();
+    if(X.empty())
+        return 0;
+    std::vector<unsigned int> cov;
+    for(unsigned int i = 1;i < x_col_count;++i) // skip intercept at i = 0
+        if(i != study_feature)
+            cov.push_back(i);
+    if(cov.empty())
+        return 0;
+    size_t n = X.size()/x_col_count;
+    P.resize(cov.size()*n);
+    Xc.resize(n*cov.size());
+    std::vector<float> e(n);
+    std::vector<double> b(x_col_count);
+    for(size_t j = 0;j < n;++j)
+    {
+        e[j] = 1.0f;
+        mr.regress(&*e.begin(),&*b.begin());
+        e[j] = 0.0f;
+        for(size_t l = 0;l < cov.size();++l)
+        {
+            P[l*n+j] = float(b[cov[l]]);
+            Xc[j*cov.size()+l] = float(mr.X[j*x_col_count+cov[l]]-X_mean[cov[l]]);
+        }
+    }
+    return uint32_t(cov.size());
+}
 double stat_model::operator()(const std::vector<float>& original_population) const
 {
     std::vector<float> population(selected_subject.size());
@@ -1358,3 +1876,65 @@ double stat_model::operator()(const std::vector<float>& original_population) con
     }
     return 0.0;
 }
+double stat_model::operator()(const std::vector<float>& original_population,
+                              const uint16_t* population_rank,buffer& buf) const
+{
+    size_t n = sample_map.size();
+    if(study_feature)
+    {
+        auto& rank = buf.rank;
+        rank.resize(n);
+        // population_rank is only given for populations without ties, and a bootstrap sample may repeat subjects,
+        // so the counting sort is used only when it gives the same ranks as tipl::rank
+        if(population_rank && resample_order.empty())
+        {
+            // population_rank holds the rank of each subject in the original population,
+            // a counting sort on it gives the rank of the permuted population in O(n)
+            auto& count = buf.count;
+            count.assign(n+1,0);
+            for(size_t i = 0;i < n;++i)
+                ++count[population_rank[sample_map[i]]+1];
+            for(size_t i = 1;i <= n;++i)
+                count[i] += count[i-1];
+            for(size_t i = 0;i < n;++i)
+                rank[i] = count[population_rank[sample_map[i]]]++;
+        }
+        else
+        {
+            buf.population.resize(n);
+            for(size_t i = 0;i < n;++i)
+                buf.population[i] = original_population[sample_map[i]];
+            auto r = tipl::rank(buf.population,std::less<float>());
+            std::copy(r.begin(),r.end(),rank.begin());
+        }
+        // branch-free so that the compiler vectorizes it
+        const unsigned int* r = rank.data();
+        const unsigned int* x = x_study_feature_rank.data();
+        int64_t sum_d2 = 0;
+        for(size_t i = 0;i < n;++i)
+        {
+            int64_t d = int64_t(r[i])-int64_t(x[i]);
+            sum_d2 += d*d;
+        }
+        double r_value = 1.0-double(sum_d2)*rank_c;
+        double result = r_value*std::sqrt(double(n-2.0)/(1.0-r_value*r_value));
+        return std::isnormal(result) ? result : 0.0;
+    }
+    // if study longitudinal change
+    auto& population = buf.population;
+    population.resize(n);
+    if(permutation_order.empty())
+    {
+        for(size_t i = 0;i < n;++i)
+            population[i] = original_population[sample_map[i]];
+    }
+    else
+    {
+        // same sign-flip rule as the unbuffered version
+        for(size_t i = 0;i < n;++i)
+            population[i] = permutation_order[i] ? -original_population[sample_map[i]] : 0.0f;
+    }
+    double mean = tipl::mean(population);
+    double se = tipl::standard_deviation(population.begin(),population.end(),mean)/std::sqrt(population.size());
+    return se == 0.0 ? 0.0 : mean/se;
+}
@@ -36,6 +36,27 @@ public:
     tipl::image<3,size_t> vi2si;
     std::vector<size_t> si2vi;
     std::string index_name = "qa";
+public:// fixel-major chunks: each chunk holds fixel_chunk_size fixels with all subjects contiguous
+    bool fixel_major = false;       // save_db: also write fixel-major chunks
+    bool fixel_quantize = false;    // save_db: store the chunks as uint16 quantized to each fixel's range (lossy)
+    size_t fixel_chunk_size = 4096;
+    unsigned int fixel_chunk_count = 0; // chunks in the loaded file that match subject_qa
+    bool get_fixel_chunk(unsigned int chunk,std::vector<float>& values) const;
+    // subject_qa entries are null until loaded when the statistics can use the fixel-major chunks.
+    // every reader of subject_qa loads the subjects it needs first
+    bool load_subject_qa(unsigned int index);
+    bool load_subject_qa(void);
+public:// incremental append: subjects added after loading are saved to <db>.append<k>.gz shards
+    unsigned int stored_subject_count = 0; // subjects already in the db file and its shards
+    unsigned int shard_count = 0;
+    bool metadata_only = false; // read_db: only count the stored subjects, leaving subject_qa null (for append_db)
+    std::vector<const float*> stored_subject_qa;
+    // the shards must be kept next to the db file: moving or copying the db alone drops the appended subjects
+    static std::string shard_file_name(const std::string& db_file_name,unsigned int k)
+    {
+        return db_file_name+".append"+std::to_string(k)+".gz";
+    }
+    bool append_db(void);
 public://longitudinal studies
     std::vector<std::pair<int,int> > match;
     void calculate_change(unsigned char dif_type,unsigned char filter_type);
@@ -46,18 +67,29 @@ public:
     void clear(void);
     void remove_subject(unsigned int index);
     void calculate_si2vi(void);
-    bool is_odf_consistent(tipl::io::gz_mat_read& m);
+    bool is_odf_consistent(tipl::io::gz_mat_read& m,std::string& reason) const;
     void sample_from_image(tipl::const_pointer_image<3,float> I,
-                           const tipl::matrix<4,4>& trans,std::vector<float>& data);
+                           const tipl::matrix<4,4>& trans,std::vector<float>& data) const;
+public:// subject ingestion
+    struct subject_data{
+        std::string file_name,subject_name,report,error_msg;
+        std::vector<float> data;
+        float R2 = 1.0f;
+        std::shared_ptr<fib_data> db_fib; // the file itself is a connectometry db
+    };
+    bool load_subject(subject_data& subject) const; // thread-safe, does not modify the db
+    bool add_subject(subject_data& subject);
     bool add(const std::string& file_name,
                             const std::string& subject_name);
+    bool add(const std::vector<std::string>& file_names,
+             const std::vector<std::string>& subject_names,unsigned int thread_count);
     bool save_db(const char* output_name);
     void get_subject_slice(unsigned int subject_index,unsigned char dim,unsigned int pos,
-                            tipl::image<2,float>& slice) const;
-    bool get_demo_matched_volume(const std::string& matched_demo,tipl::image<3>& volume) const;
-    bool save_demo_matched_image(const std::string& matched_demo,const std::string& filename) const;
-    void get_subject_volume(unsigned int subject_index,tipl::image<3>& volume) const;
-    void get_subject_fa(unsigned int subject_index,std::vector<std::vector<float> >& fa_data) const;
+                            tipl::image<2,float>& slice);
+    bool get_demo_matched_volume(const std::string& matched_demo,tipl::image<3>& volume);
+    bool save_demo_matched_image(const std::string& matched_demo,const std::string& filename);
+    void get_subject_volume(unsigned int subject_index,tipl::image<3>& volume);
+    void get_subject_fa(unsigned int subject_index,std::vector<std::vector<float> >& fa_data);
     bool get_qa_profile(const char* file_name,std::vector<std::vector<float> >& data);
     bool is_db_compatible(const connectometry_db& rhs);
     bool add_db(const connectometry_db& rhs);
@@ -105,7 +137,16 @@ public:
     bool resample(stat_model& rhs,bool null,bool bootstrap,unsigned int seed);
     bool pre_process(void);
     void partial_correlation(std::vector<float>& population) const;
+    unsigned int partial_correlation_projection(std::vector<float>& P,std::vector<float>& Xc) const;
     double operator()(const std::vector<float>& population) const;
+public: // allocation-free statistics for the SPM kernel
+    struct buffer{
+        std::vector<float> population;
+        std::vector<unsigned int> rank,count;
+    };
+    // sample_map[i] is the subject feeding the i-th resampled and permuted value
+    std::vector<unsigned int> sample_map;
+    double operator()(const std::vector<float>& population,const uint16_t* population_rank,buffer& buf) const;
     void clear(void)
     {
         X.clear();
@@ -133,6 +174,11 @@ struct connectometry_result{
     std::vector<std::vector<float> > inc,dec;
     std::vector<const float*> inc_ptr,dec_ptr;
     void clear_result(char num_fiber,size_t image_size);
+public: // sparse layout: signed T at fib*fixel_count+si, no dense volumes
+    bool sparse = false;
+    size_t fixel_count = 0;
+    std::vector<float> fixel_t;
+    void clear_fixel_result(char num_fiber,size_t fixel_count_);
 };
 
 
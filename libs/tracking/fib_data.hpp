@@ -67,6 +67,11 @@ public:
     std::vector<const short*> findex;
     std::vector<tipl::vector<3,float> > odf_table;
     std::shared_ptr<tipl::image<3> > dt_fa_data;
+public: // sparse differential metrics: dt_sign*dt_fixel[fib*dt_fixel_count+dt_vi2si[voxel]]
+    const float* dt_fixel = nullptr;
+    const size_t* dt_vi2si = nullptr;
+    size_t dt_fixel_count = 0;
+    float dt_sign = 1.0f;
 
     const tracking_data& operator=(const tracking_data& rhs) = delete;
 public:
@@ -94,6 +99,8 @@ public:
             {
                 if (!dt_fa.empty() && dt_fa[index][space_index] <= dt_threshold) // for differential tractography
                     continue;
+                if (dt_fixel && dt_sign*dt_fixel[index*dt_fixel_count+dt_vi2si[space_index]] <= dt_threshold)
+                    continue;
                 float value = cos_angle(ref_dir,space_index,index);
                 if (-value > max_value)
                 {
@@ -63,6 +63,25 @@ public:
             return false;
         return (xyz_hash[z_base+(uint16_t(z) >> 5)] & (1 << (z & 31)));
     }
+    __HOST__ void get_points(std::vector<tipl::vector<3,short> >& points) const
+    {
+        points.clear();
+        for(uint16_t x = 0;x < dim[0];++x)
+        {
+            auto y_base = xyz_hash[x];
+            if(!y_base)
+                continue;
+            for(uint16_t y = 0;y < dim[1];++y)
+            {
+                auto z_base = xyz_hash[y_base+y];
+                if(!z_base)
+                    continue;
+                for(uint16_t z = 0;z < dim[2];++z)
+                    if(xyz_hash[z_base+(z >> 5)] & (1 << (z & 31)))
+                        points.push_back(tipl::vector<3,short>(x,y,z));
+            }
+        }
+    }
     __INLINE__ bool included(const float* track,unsigned int buffer_size) const
     {
         auto end = track + buffer_size;
@@ -235,6 +254,25 @@ public:
         }
         return false;
     }
+    // voxels of the smallest region that every selected tract must pass, used to narrow tract loading
+    void get_required_region(std::vector<tipl::vector<3,short> >& points) const
+    {
+        points.clear();
+        auto check = [&](const std::vector<std::shared_ptr<Roi> >& regions)
+        {
+            for(const auto& region : regions)
+                if(!region->need_trans)
+                {
+                    std::vector<tipl::vector<3,short> > p;
+                    region->get_points(p);
+                    if(points.empty() || p.size() < points.size())
+                        points.swap(p);
+                }
+        };
+        check(roi);
+        if(end.size() <= 2)
+            check(end);
+    }
     bool within_roi(const float* track,unsigned int buffer_size) const
     {
         for(unsigned int index = 0; index < roi.size(); ++index)
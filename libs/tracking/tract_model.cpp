@@ -62,6 +62,11 @@ class TinyTrack{
     };
 
     public:
+    // tracks are written in blocks of up to block_size bytes, and each block records its
+    // bounding box and the coarse cells (cell_size voxels wide) it passes through, so that
+    // a region query only needs to decode the blocks that can reach the region.
+    static constexpr size_t block_size = 16777216; // 16 mb
+    static constexpr unsigned int cell_size = 8;
     static bool save_to_file(const char* file_name,
                              tipl::shape<3> geo,
                              tipl::vector<3> vs,
@@ -150,6 +155,11 @@ class TinyTrack{
             if(prog.aborted())
                 return false;
         }
+        // spatial index: bounding box and coarse cell occupancy of each track block
+        tipl::shape<3> cell_dim((geo[0]+cell_size-1)/cell_size,(geo[1]+cell_size-1)/cell_size,(geo[2]+cell_size-1)/cell_size);
+        std::vector<float> block_bbox;
+        std::vector<unsigned char> block_cell;
+        std::vector<uint32_t> block_track_count;
         {
             tipl::progress prog("saving file");
             for(size_t block = 0,cur_track_block = 0;prog(cur_track_block,track32.size());++block)
@@ -161,9 +171,49 @@ class TinyTrack{
                 {
                     pos.push_back(total_size);
                     total_size += buf_size[i];
-                    if(total_size > 134217728) // 128 mb
+                    if(total_size > block_size)
                         break;
                 }
+                {
+                    unsigned int thread_count = std::thread::hardware_concurrency();
+                    std::vector<std::vector<unsigned char> > cells(thread_count,std::vector<unsigned char>(cell_dim.size()));
+                    const float fmax = std::numeric_limits<float>::max();
+                    std::vector<tipl::vector<3> > bmin(thread_count,tipl::vector<3>(fmax,fmax,fmax)),
+                                                  bmax(thread_count,tipl::vector<3>(-fmax,-fmax,-fmax));
+                    tipl::par_for(pos.size(),[&](size_t i,size_t thread_id)
+                    {
+                        const auto& t = tract_data[cur_track_block+i];
+                        for(size_t j = 0;j+2 < t.size();j += 3)
+                        {
+                            tipl::vector<3> p(&t[j]);
+                            for(unsigned char d = 0;d < 3;++d)
+                            {
+                                bmin[thread_id][d] = std::min(bmin[thread_id][d],p[d]);
+                                bmax[thread_id][d] = std::max(bmax[thread_id][d],p[d]);
+                            }
+                            // rounded the same way Roi::havePoint does
+                            int x = int(std::round(p[0]))/int(cell_size);
+                            int y = int(std::round(p[1]))/int(cell_size);
+                            int z = int(std::round(p[2]))/int(cell_size);
+                            if(cell_dim.is_valid(x,y,z))
+                                cells[thread_id][(size_t(z)*cell_dim[1]+size_t(y))*cell_dim[0]+size_t(x)] = 1;
+                        }
+                    },thread_count);
+                    for(unsigned int t = 1;t < thread_count;++t)
+                    {
+                        for(unsigned char d = 0;d < 3;++d)
+                        {
+                            bmin[0][d] = std::min(bmin[0][d],bmin[t][d]);
+                            bmax[0][d] = std::max(bmax[0][d],bmax[t][d]);
+                        }
+                        for(size_t j = 0;j < cell_dim.size();++j)
+                            cells[0][j] |= cells[t][j];
+                    }
+                    block_bbox.insert(block_bbox.end(),bmin[0].begin(),bmin[0].end());
+                    block_bbox.insert(block_bbox.end(),bmax[0].begin(),bmax[0].end());
+                    block_cell.insert(block_cell.end(),cells[0].begin(),cells[0].end());
+                    block_track_count.push_back(uint32_t(pos.size()));
+                }
 
                 std::vector<char> out_buf(total_size);
                 tipl::par_for(pos.size(),[&](size_t i)
@@ -190,6 +240,13 @@ class TinyTrack{
             if(prog.aborted())
                 return false;
         }
+        if(!block_cell.empty())
+        {
+            out.write("block_cell_dim",cell_dim);
+            out.write("block_bbox",&block_bbox[0],6,block_bbox.size()/6);
+            out.write("block_cell",&block_cell[0],cell_dim.size(),block_cell.size()/cell_dim.size());
+            out.write("block_track_count",&block_track_count[0],1,block_track_count.size());
+        }
         return true;
     }
     static bool load_from_file(const char* file_name,
@@ -197,13 +254,25 @@ class TinyTrack{
                                std::vector<uint16_t>& tract_cluster,
                                tipl::shape<3>& geo,tipl::vector<3>& vs,
                                tipl::matrix<4,4>& trans_to_mni,
-                               std::string& report,std::string& parameter_id,unsigned int& color)
+                               std::string& report,std::string& parameter_id,unsigned int& color,
+                               const std::vector<tipl::vector<3,short> >* region = nullptr,
+                               const tipl::shape<3>& region_dim = tipl::shape<3>(),
+                               const tipl::vector<3>& region_vs = tipl::vector<3>(),
+                               const tipl::matrix<4,4>& region_trans = tipl::matrix<4,4>())
     {
         tipl::progress prog_("loading ",std::filesystem::path(file_name).filename().c_str());
         tipl::io::gz_mat_read in;
         prepare_idx(file_name,in.in);
+        if(region && in.in->has_access_points())
+        {
+            in.delay_read = true;
+            in.in->buffer_all = false;
+        }
         if (!in.load_from_file(file_name))
             return false;
+        for(size_t i = 0;i < in.size();++i)
+            if(in[i].get_name().find("track") != 0 && in[i].has_delay_read() && !in[i].read(*(in.in.get())))
+                return false;
         in.read("dimension",geo);
         in.read("voxel_size",vs);
         in.read("trans_to_mni",trans_to_mni);
@@ -220,9 +289,46 @@ class TinyTrack{
             std::copy(cluster,cluster+tract_cluster.size(),tract_cluster.begin());
         }
 
+        // decide which track blocks can intersect the region, and only decompress those
+        std::vector<char> selected_block;
+        if(region)
+        {
+            selected_block = select_blocks(in,*region,region_dim,region_vs,region_trans);
+            if(!selected_block.empty())
+            {
+                // keep the cluster labels of the selected blocks only
+                const uint32_t* count = nullptr;
+                if(!tract_cluster.empty() && in.read("block_track_count",row,col,count) && size_t(row)*size_t(col) == selected_block.size())
+                {
+                    std::vector<uint16_t> selected_cluster;
+                    for(size_t b = 0,pos = 0;b < selected_block.size() && pos+count[b] <= tract_cluster.size();pos += count[b++])
+                        if(selected_block[b])
+                            selected_cluster.insert(selected_cluster.end(),tract_cluster.begin()+pos,tract_cluster.begin()+pos+count[b]);
+                    tract_cluster.swap(selected_cluster);
+                }
+                tipl::out() << "spatial index: " << std::count(selected_block.begin(),selected_block.end(),1)
+                            << " of " << selected_block.size() << " track blocks intersect the region" << std::endl;
+            }
+        }
+        for(size_t i = 0;i < in.size();++i)
+            if(in[i].has_delay_read())
+            {
+                auto name = in[i].get_name();
+                if(!selected_block.empty() && name.find("track") == 0)
+                {
+                    size_t block = (name == "track" ? 0 : std::stoul(name.substr(5)));
+                    if(block < selected_block.size() && !selected_block[block])
+                        continue;
+                }
+                if(!in[i].read(*(in.in.get())))
+                    return false;
+            }
+
         for(unsigned int block = 0;1;block++)
         {
             const char* track_buf = nullptr;
+            if(block < selected_block.size() && !selected_block[block])
+                continue;
             if(block == 0)
             {
                 if(!in.read("track",row,col,track_buf))
@@ -268,6 +374,71 @@ class TinyTrack{
         save_idx(file_name,in.in);
         return true;
     }
+    // returns one flag per track block, or empty if the file has no usable spatial index
+    // the index is only used if the tracts are in the region's space, so that no transform follows loading
+    static std::vector<char> select_blocks(tipl::io::gz_mat_read& in,
+                                           const std::vector<tipl::vector<3,short> >& region,
+                                           const tipl::shape<3>& region_dim,
+                                           const tipl::vector<3>& region_vs,
+                                           const tipl::matrix<4,4>& region_trans)
+    {
+        tipl::shape<3> geo,cell_dim;
+        tipl::vector<3> vs;
+        tipl::matrix<4,4> trans;
+        unsigned int row,col,cell_row,cell_col;
+        const float* bbox = nullptr;
+        const unsigned char* cell = nullptr;
+        if(region.empty() || !in.read("dimension",geo) || geo != region_dim ||
+           !in.read("voxel_size",vs) || vs != region_vs ||
+           !in.read("trans_to_mni",trans) || trans != region_trans ||
+           !in.read("block_cell_dim",cell_dim) ||
+           !in.read("block_bbox",row,col,bbox) || row != 6 ||
+           !in.read("block_cell",cell_row,cell_col,cell) || cell_row != cell_dim.size() || cell_col != col)
+            return std::vector<char>();
+
+        tipl::vector<3> rmin(region[0][0],region[0][1],region[0][2]),rmax(rmin);
+        std::vector<unsigned char> region_cell(cell_dim.size());
+        for(const auto& p : region)
+        {
+            for(unsigned char d = 0;d < 3;++d)
+            {
+                rmin[d] = std::min<float>(rmin[d],p[d]);
+                rmax[d] = std::max<float>(rmax[d],p[d]);
+            }
+            if(cell_dim.is_valid(p[0]/int(cell_size),p[1]/int(cell_size),p[2]/int(cell_size)))
+                region_cell[(size_t(p[2]/cell_size)*cell_dim[1]+size_t(p[1]/cell_size))*cell_dim[0]+size_t(p[0]/cell_size)] = 1;
+        }
+        // track coordinates are rounded to the nearest voxel when checked against a region
+        rmin -= tipl::vector<3>(0.5f,0.5f,0.5f);
+        rmax += tipl::vector<3>(0.5f,0.5f,0.5f);
+        std::vector<char> selected(col);
+        tipl::par_for(col,[&](size_t b)
+        {
+            auto bmin = bbox + b*6;
+            auto bmax = bmin + 3;
+            for(unsigned char d = 0;d < 3;++d)
+                if(bmax[d] < rmin[d] || bmin[d] > rmax[d])
+                    return;
+            auto c = cell + b*cell_dim.size();
+            // indices written before cells were rounded may be one cell off in any direction
+            for(int z = 0;z < int(cell_dim[2]);++z)
+                for(int y = 0;y < int(cell_dim[1]);++y)
+                    for(int x = 0;x < int(cell_dim[0]);++x)
+                    {
+                        if(!region_cell[(size_t(z)*cell_dim[1]+size_t(y))*cell_dim[0]+size_t(x)])
+                            continue;
+                        for(int dz = std::max(z-1,0);dz <= std::min(z+1,int(cell_dim[2])-1);++dz)
+                            for(int dy = std::max(y-1,0);dy <= std::min(y+1,int(cell_dim[1])-1);++dy)
+                                for(int dx = std::max(x-1,0);dx <= std::min(x+1,int(cell_dim[0])-1);++dx)
+                                    if(c[(size_t(dz)*cell_dim[1]+size_t(dy))*cell_dim[0]+size_t(dx)])
+                                    {
+                                        selected[b] = 1;
+                                        return;
+                                    }
+                    }
+        });
+        return selected;
+    }
 };
 
 struct TrackVis
@@ -682,7 +853,8 @@ bool apply_unwarping_tt(const char* from,
     }
     return true;
 }
-bool TractModel::load_tracts_from_file(const char* file_name_,fib_data* handle,bool tract_is_mni)
+bool TractModel::load_tracts_from_file(const char* file_name_,fib_data* handle,bool tract_is_mni,
+                                       const std::vector<tipl::vector<3,short> >* region)
 {
     std::string file_name(file_name_);
     std::vector<std::vector<float> > loaded_tract_data;
@@ -694,13 +866,17 @@ bool TractModel::load_tracts_from_file(const char* file_name_,fib_data* handle,b
         color = 0x00F04040;
 
     tipl::matrix<4,4> source_trans_to_mni(trans_to_mni);
+    bool region_filtered = false;
 
     if(QString(file_name_).endsWith("tt.gz"))
     {
         unsigned int old_color = color;
         std::vector<uint16_t> cluster;
-        if(!TinyTrack::load_from_file(file_name_,loaded_tract_data,cluster,geo,vs,source_trans_to_mni,report,parameter_id,color))
+        if(!TinyTrack::load_from_file(file_name_,loaded_tract_data,cluster,geo,vs,source_trans_to_mni,report,parameter_id,color,
+                                      tract_is_mni ? nullptr : region,handle->dim,handle->vs,handle->trans_to_mni))
             return false;
+        // no tract near the region is a valid result
+        region_filtered = region && !tract_is_mni;
         if(geo == handle->dim && vs == handle->vs && !tract_is_mni && source_trans_to_mni != handle->trans_to_mni)
         {
             tipl::out() << "identical dimension: overwriting tractography transformation matrix." << std::endl;
@@ -790,7 +966,7 @@ bool TractModel::load_tracts_from_file(const char* file_name_,fib_data* handle,b
 
 
 
-    if (loaded_tract_data.empty())
+    if (loaded_tract_data.empty() && !region_filtered)
         return false;
     if(loaded_tract_cluster.size() == loaded_tract_data.size())
         loaded_tract_cluster.swap(tract_cluster);
@@ -74,7 +74,11 @@ public:
             return *this;
         }
         void add(const TractModel& rhs);
-        bool load_tracts_from_file(const char* file_name,fib_data* handle,bool tract_is_mni = false);
+        // region (optional, in handle voxel space) allows a .tt.gz file with a spatial index to load
+        // only the track blocks that may pass the region. the result is a superset of the tracts
+        // passing the region and still needs filtering.
+        bool load_tracts_from_file(const char* file_name,fib_data* handle,bool tract_is_mni = false,
+                                   const std::vector<tipl::vector<3,short> >* region = nullptr);
 
         bool save_tracts_to_file(const char* file_name);
         bool save_tracts_in_native_space(std::shared_ptr<fib_data> handle,const char* file_name);
@@ -391,6 +391,7 @@ int run_cmd(int ac, char *av[])
 
 extern console_stream console;
 
+#ifndef DSI_STUDIO_TEST
 int main(int ac, char *av[])
 {
     if(ac > 2)
@@ -483,3 +484,4 @@ int main(int ac, char *av[])
     }
     return 1;
 }
+#endif
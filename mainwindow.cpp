@@ -8,6 +8,9 @@
 #include <QAction>
 #include <QStyleFactory>
 #include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
 #include "regtoolbox.h"
@@ -1202,12 +1205,13 @@ bool dcm2src_and_nii(QStringList files)
     return true;
 }
 
-void dicom2src_and_nii(std::string dir_)
+// DICOM files are converted in groups: each folder, aggregated with consecutive folders holding
+// identically named files; folders without DICOM are searched one level deeper
+static void get_dicom_groups(const std::string& dir_,std::vector<QStringList>& groups)
 {
-    tipl::progress prog("convert DICOM to NIFTI/SRC");
     QStringList dir_list = GetSubDir(dir_.c_str(),false);
     bool has_dicom = false;
-    for(int i = 0;prog(i,dir_list.size());++i)
+    for(int i = 0;i < dir_list.size();++i)
     {
         QDir cur_dir = dir_list[i];
         QStringList dicom_file_list = cur_dir.entryList(QStringList("*.dcm"),QDir::Files|QDir::NoSymLinks);
@@ -1216,18 +1220,115 @@ void dicom2src_and_nii(std::string dir_)
         has_dicom = true;
         // aggregate DWI with identical names from consecutive folders
         QStringList aggregated_file_list;
-        for(;prog(i,dir_list.size());++i)
+        for(;i < dir_list.size();++i)
         {
             for (int index = 0;index < dicom_file_list.size();++index)
                 aggregated_file_list << dir_list[i] + "/" + dicom_file_list[index];
             if(i+1 < dir_list.size() && !QFileInfo(dir_list[i+1] + "/" + dicom_file_list[0]).exists())
                 break;
         }
-        dcm2src_and_nii(aggregated_file_list);
+        groups.push_back(aggregated_file_list);
     }
     if(!has_dicom)
         for(auto dir : dir_list)
-            dicom2src_and_nii(dir.toStdString());
+            get_dicom_groups(dir.toStdString(),groups);
+}
+
+// persistent index for incremental DICOM conversion: records the outcome of each file group
+// together with a signature of its file names and modification times, so that a repeat scan
+// of a growing archive skips unchanged groups, whether they were converted or failed
+struct dicom_header_index{
+    struct entry{
+        std::string status; // "converted" or "failed"
+        std::string signature;
+    };
+    std::string file_name;
+    std::map<std::string,entry> groups;
+    static std::string get_signature(const QStringList& file_list)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        auto add = [&](const std::string& str)
+        {
+            for(auto c : str)
+                hash = (hash ^ uint64_t(uint8_t(c)))*1099511628211ull;
+        };
+        for(const auto& each : file_list)
+        {
+            auto path = each.toStdString();
+            std::error_code ec;
+            auto t = std::filesystem::last_write_time(path,ec);
+            add(path);
+            add(std::to_string(ec ? 0 : int64_t(t.time_since_epoch().count())));
+        }
+        std::ostringstream out;
+        out << file_list.size() << ":" << std::hex << hash;
+        return out.str();
+    }
+    void load(const std::string& file_name_)
+    {
+        file_name = file_name_;
+        std::ifstream in(file_name);
+        std::string line;
+        while(std::getline(in,line))
+        {
+            std::istringstream line_in(line);
+            std::string type,key;
+            entry e;
+            if(!std::getline(line_in,type,'\t') || type != "group" ||
+               !std::getline(line_in,key,'\t') ||
+               !std::getline(line_in,e.status,'\t') ||
+               !std::getline(line_in,e.signature))
+                continue;
+            groups[key] = e;
+        }
+        if(!groups.empty())
+            tipl::out() << "DICOM index: " << groups.size() << " groups recorded in " << file_name << std::endl;
+    }
+    bool save(void) const
+    {
+        std::ofstream out(file_name);
+        if(!out)
+            return false;
+        for(const auto& each : groups)
+            out << "group\t" << each.first << "\t" << each.second.status << "\t" << each.second.signature << std::endl;
+        return true;
+    }
+};
+
+void dicom2src_and_nii(std::string dir_,bool incremental,std::string index_file)
+{
+    std::vector<QStringList> groups;
+    get_dicom_groups(dir_,groups);
+
+    dicom_header_index index;
+    if(incremental)
+        index.load(index_file.empty() ? dir_ + "/dsi_studio_dicom_index.txt" : index_file);
+
+    tipl::progress prog("convert DICOM to NIFTI/SRC");
+    for(size_t i = 0;prog(i,groups.size());++i)
+    {
+        if(!incremental)
+        {
+            dcm2src_and_nii(groups[i]);
+            continue;
+        }
+        // groups are identified by their first folder
+        std::string key = QFileInfo(groups[i][0]).absolutePath().toStdString();
+        std::string signature = dicom_header_index::get_signature(groups[i]);
+        auto iter = index.groups.find(key);
+        if(iter != index.groups.end() && iter->second.signature == signature)
+        {
+            tipl::out() << "skip " << key << ": " << iter->second.status << " previously and unchanged since" << std::endl;
+            continue;
+        }
+        index.groups[key] = {dcm2src_and_nii(groups[i]) ? "converted" : "failed",signature};
+        if(!index.save())
+            tipl::out() << "ERROR: cannot save " << index.file_name << std::endl;
+    }
+}
+void dicom2src_and_nii(std::string dir_)
+{
+    dicom2src_and_nii(dir_,false,std::string());
 }
 
 void MainWindow::on_dicom2nii_clicked()
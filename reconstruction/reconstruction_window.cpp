@@ -116,7 +116,7 @@ reconstruction_window::reconstruction_window(QStringList filenames_,QWidget *par
         for(int i = 4;i < actions.size();++i)
             actions[i]->setVisible(false);
 
-        ui->hist_downsampling->setValue(std::ceil(std::log2(handle->voxel.hist_image.width()))-12);
+        ui->hist_downsampling->setValue(std::ceil(std::log2(handle->voxel.hist_shape().width()))-12);
     }
 
 
@@ -0,0 +1,50 @@
+#include <iostream>
+#include <map>
+#include <random>
+#include "basic_voxel.hpp"
+#include "odf_process.hpp"
+
+// compares SearchLocalMaximum::search with the former map-based search on a fixed
+// set of ODFs, including quantized ones with many tied values
+int odf_search_test(void)
+{
+    Voxel voxel;
+    SearchLocalMaximum lm;
+    lm.init(voxel);
+    std::mt19937 gen(0);
+    std::uniform_real_distribution<float> dis(0.0f,1.0f);
+    std::vector<float> odf(voxel.ti.half_vertices_count);
+    std::vector<std::pair<float,unsigned short> > max_table;
+    for (unsigned int trial = 0;trial < 64;++trial)
+    {
+        for (auto& v : odf)
+            v = (trial & 1) ? std::round(dis(gen)*8.0f) : dis(gen);
+        std::map<float,unsigned short,std::greater<float> > reference;
+        for (uint32_t index = 0;index < odf.size();++index)
+        {
+            bool is_max = true;
+            for (uint32_t j = lm.neighbor_pos[index];j < lm.neighbor_pos[index+1];++j)
+                if (odf[index] < odf[lm.neighbor[j]])
+                {
+                    is_max = false;
+                    break;
+                }
+            if (is_max)
+                reference[odf[index]] = uint16_t(index);
+        }
+        for (size_t k = 1;k <= 5;++k)
+        {
+            lm.search(odf,max_table,k);
+            bool matched = max_table.size() == std::min(k,reference.size());
+            auto iter = reference.begin();
+            for (size_t i = 0;matched && i < max_table.size();++i,++iter)
+                matched = max_table[i].first == iter->first && max_table[i].second == iter->second;
+            if (!matched)
+            {
+                std::cout << "FAILED: trial " << trial << " k=" << k << " differs from the map-based search" << std::endl;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+#include <iostream>
+#include <string>
+// tests are run by name, e.g. dsi_studio_test voxel_allocation
+int voxel_allocation_test(void);
+int odf_search_test(void);
+int main(int ac, char *av[])
+{
+    if(ac != 2)
+    {
+        std::cout << "usage: dsi_studio_test <test name>" << std::endl;
+        return 1;
+    }
+    std::string name(av[1]);
+    if(name == "voxel_allocation")
+        return voxel_allocation_test();
+    if(name == "odf_search")
+        return odf_search_test();
+    std::cout << "unknown test: " << name << std::endl;
+    return 1;
+}
@@ -0,0 +1,87 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "basic_voxel.hpp"
+#include "odf_process.hpp"
+#include "dti_process.hpp"
+#include "gqi_process.hpp"
+
+// every heap allocation of the test program is counted
+static std::atomic<size_t> allocation_count(0);
+void* operator new(size_t size)
+{
+    ++allocation_count;
+    if(void* ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+void operator delete(void* ptr,size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void calculate_shell(std::vector<float> sorted_bvalues,std::vector<unsigned int>& shell);
+
+// runs the GQI chain on a synthetic two-shell acquisition and checks that
+// the voxel loop allocates a bounded number of times, not once per voxel
+int voxel_allocation_test(void)
+{
+    Voxel voxel;
+    voxel.dim = tipl::shape<3>(24,24,24);
+    voxel.vs = tipl::vector<3>(2.0f,2.0f,2.0f);
+    voxel.mask.resize(voxel.dim);
+    voxel.mask = 1;
+    voxel.method_id = 4;
+    voxel.thread_count = 1;
+    voxel.other_output = "fa,ad,rd,md,iso,rdi";
+
+    // b0 and two shells sampled on the half sphere
+    voxel.bvalues.push_back(0.0f);
+    voxel.bvectors.push_back(tipl::vector<3>());
+    for(float b : {1000.0f,2000.0f})
+        for(unsigned int i = 0;i < voxel.ti.half_vertices_count;i += 5)
+        {
+            voxel.bvalues.push_back(b);
+            voxel.bvectors.push_back(voxel.ti.vertices[i]);
+        }
+    calculate_shell(voxel.bvalues,voxel.shell);
+    voxel.scheme_balance = true;
+
+    // one fiber along x with a small variation across voxels
+    std::vector<tipl::image<3,unsigned short> > dwi(voxel.bvalues.size(),tipl::image<3,unsigned short>(voxel.dim));
+    for(size_t i = 0;i < dwi.size();++i)
+    {
+        for(size_t pos = 0;pos < dwi[i].size();++pos)
+        {
+            float c = voxel.bvectors[i][0];
+            float d = 0.0003f + 0.0014f*(1.0f-c*c) + 0.00001f*float(pos%7);
+            dwi[i][pos] = (unsigned short)(1000.0f*std::exp(-voxel.bvalues[i]*d));
+        }
+        voxel.dwi_data.push_back(&dwi[i][0]);
+    }
+
+    if(!voxel.init_process<ReadDWIData,Dwi2Tensor,BalanceScheme,GQI_Recon,RDI_Recon,SaveMetrics>())
+    {
+        std::cout << "cannot initialize the reconstruction" << std::endl;
+        return 1;
+    }
+    size_t before = allocation_count;
+    if(!voxel.run<ReadDWIData,Dwi2Tensor,BalanceScheme,GQI_Recon,RDI_Recon,SaveMetrics>("test"))
+    {
+        std::cout << "reconstruction failed" << std::endl;
+        return 1;
+    }
+    size_t count = allocation_count-before;
+    std::cout << count << " allocations for " << voxel.dim.size() << " voxels" << std::endl;
+    // setup, progress and the scratch buffers sized by the first voxel allocate, the voxels after do not
+    if(count >= voxel.dim.size()/8)
+    {
+        std::cout << "FAILED: the voxel loop allocates memory for each voxel" << std::endl;
+        return 1;
+    }
+    return 0;
+}